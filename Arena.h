@@ -0,0 +1,184 @@
+#pragma once
+
+#include <vector>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <stddef.h>
+#include <stdlib.h>
+
+//Bump allocator for objects that all live until the same moment, like everything a scene loads.
+//Objects are placed one after another in large blocks; reset() runs their destructors, newest
+//first, and keeps the blocks for the next round, so loading the same level again allocates
+//nothing from the heap. Not thread safe.
+class Arena
+{
+    struct Block
+    {
+        char* memory;
+        size_t size;
+    };
+
+    struct Destructor
+    {
+        void (*destroy)(void*);
+        void* object;
+        Destructor* next;
+    };
+
+    std::vector<Block> blocks;
+    size_t blockSize;
+    unsigned int current;       // block being filled
+    size_t used;                // bytes of it taken
+    Destructor* destructors;    // newest first
+    size_t objects;
+
+    template<typename T>
+    static void destroyObject(void* object)
+    {
+        ((T*)object)->~T();
+    }
+
+public:
+    Arena(size_t blockSize = 64 * 1024):blockSize(blockSize),current(0),used(0),destructors(0),objects(0){}
+
+    ~Arena()
+    {
+        reset();
+        for (unsigned int i = 0; i < blocks.size(); i++)
+            free(blocks[i].memory);
+    }
+
+    void* allocate(size_t size, size_t alignment = alignof(max_align_t))
+    {
+        while (current < blocks.size())
+        {
+            size_t offset = (used + alignment - 1) & ~(alignment - 1);
+            if (offset + size <= blocks[current].size)
+            {
+                used = offset + size;
+                return blocks[current].memory + offset;
+            }
+            current++;
+            used = 0;
+        }
+        // blocks come from malloc, aligned for anything, so a fresh block needs no padding
+        Block block;
+        block.size = size > blockSize ? size : blockSize;
+        block.memory = (char*)malloc(block.size);
+        if (!block.memory)
+            throw std::bad_alloc();
+        blocks.push_back(block);
+        current = blocks.size() - 1;
+        used = size;
+        return block.memory;
+    }
+
+    template<typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+        {
+            Destructor* destructor = new (allocate(sizeof(Destructor), alignof(Destructor))) Destructor;
+            destructor->destroy = &destroyObject<T>;
+            destructor->object = object;
+            destructor->next = destructors;
+            destructors = destructor;
+        }
+        objects++;
+        return object;
+    }
+
+    //Destroys everything created so far, newest first, and starts over in the first block
+    void reset()
+    {
+        for (Destructor* destructor = destructors; destructor; destructor = destructor->next)
+            destructor->destroy(destructor->object);
+        destructors = 0;
+        objects = 0;
+        current = 0;
+        used = 0;
+    }
+
+    size_t objectCount()
+    {
+        return objects;
+    }
+
+    size_t capacity()
+    {
+        size_t total = 0;
+        for (unsigned int i = 0; i < blocks.size(); i++)
+            total += blocks[i].size;
+        return total;
+    }
+};
+
+//Fixed-size slots for objects of one type that come and go while the scene runs, like the props
+//of streamed world tiles. Freed slots go on a free list and are handed out again first, so memory
+//stays flat however long the session. Slots are never given back before the pool dies; destroy
+//every object before that. Not thread safe.
+template<typename T>
+class Pool
+{
+    union Slot
+    {
+        Slot* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    std::vector<Slot*> blocks;
+    unsigned int slotsPerBlock;
+    Slot* freeSlots;
+    size_t live;
+
+public:
+    Pool(unsigned int slotsPerBlock = 256):slotsPerBlock(slotsPerBlock),freeSlots(0),live(0){}
+
+    ~Pool()
+    {
+        for (unsigned int i = 0; i < blocks.size(); i++)
+            free(blocks[i]);
+    }
+
+    template<typename... Args>
+    T* create(Args&&... args)
+    {
+        if (!freeSlots)
+        {
+            Slot* block = (Slot*)malloc(sizeof(Slot) * slotsPerBlock);
+            if (!block)
+                throw std::bad_alloc();
+            blocks.push_back(block);
+            for (unsigned int i = slotsPerBlock; i-- > 0; )
+            {
+                block[i].next = freeSlots;
+                freeSlots = &block[i];
+            }
+        }
+        Slot* slot = freeSlots;
+        freeSlots = slot->next;
+        live++;
+        return new (&slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* object)
+    {
+        object->~T();
+        Slot* slot = (Slot*)object;
+        slot->next = freeSlots;
+        freeSlots = slot;
+        live--;
+    }
+
+    size_t liveCount()
+    {
+        return live;
+    }
+
+    size_t capacity()
+    {
+        return blocks.size() * slotsPerBlock;
+    }
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include <unistd.h>
+#include <OpenGL/gl.h>
+
+#include "Mesh.h"
+#include "MeshGeometry.h"
+#include "ThreadPool.h"
+#include "MipChain.h"
+#include "Profiler.h"
+
+//Imports images (mip chains, see MipChain.h) and parses meshes on a thread pool. Nothing here touches GL: the owner waits for
+//the batch with finish() and then does the uploads on the context thread. Every load is also recorded in the profiler.
+//Only our own parsers run on the pool. The skeleton Mesh loader is not known to be thread safe, so
+//finish() builds those on the calling thread, one after another.
+class AssetLoader
+{
+public:
+    struct Image
+    {
+        std::string filename;
+        GLint filtering;
+        MipChain mips;          // empty if the image could not be read
+        double seconds;         // import time
+    };
+
+    struct MeshAsset
+    {
+        std::string filename;
+        bool withMesh;
+        bool mapped;            // the geometry came from a .mbin
+        Mesh* mesh;             // 0 when the geometry was mapped from a .mbin or withMesh was not set
+        MeshGeometry* geometry;
+        double seconds;         // parse time
+    };
+
+private:
+    ThreadPool pool;
+    Profiler& profiler;
+    std::vector<Image*> images;
+    std::vector<MeshAsset*> meshes;
+    std::mutex doneMutex;
+    std::condition_variable doneCondition;
+    int pending;
+    std::chrono::steady_clock::time_point start;
+
+    static double since(std::chrono::steady_clock::time_point t)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+    }
+
+    void completed()
+    {
+        std::lock_guard<std::mutex> lock(doneMutex);
+        pending--;
+        doneCondition.notify_all();
+    }
+
+    //Waits for the pool without building anything more
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(doneMutex);
+        doneCondition.wait(lock, [this]{ return pending == 0; });
+    }
+
+public:
+    AssetLoader(Profiler& profiler, int threads = std::thread::hardware_concurrency()):pool(threads),profiler(profiler),pending(0)
+    {
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~AssetLoader()
+    {
+        wait();
+        for (unsigned int i = 0; i < images.size(); i++)
+            delete images[i];
+        for (unsigned int i = 0; i < meshes.size(); i++)
+            delete meshes[i];
+    }
+
+    void requestImage(const char* filename, GLint filtering = GL_LINEAR_MIPMAP_LINEAR)
+    {
+        Image* image = new Image();
+        image->filename = filename;
+        image->filtering = filtering;
+        images.push_back(image);
+        {
+            std::lock_guard<std::mutex> lock(doneMutex);
+            pending++;
+        }
+        pool.submit([this, image]
+                    {
+                        {
+                            ProfileScope scope(profiler, "AssetLoader::image");
+                            std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+                            image->mips.import(image->filename.c_str());
+                            image->seconds = since(t);
+                        }
+                        completed();
+                    });
+    }
+
+    //The returned asset is filled in once finish() returns. The geometry and its collision BVH are
+    //always loaded; withMesh also has finish() parse the skeleton Mesh for immediate mode drawing when there is no .mbin.
+    MeshAsset* requestMesh(const char* filename, bool withMesh)
+    {
+        MeshAsset* asset = new MeshAsset();
+        asset->filename = filename;
+        asset->withMesh = withMesh;
+        asset->mapped = false;
+        asset->mesh = 0;
+        asset->geometry = 0;
+        meshes.push_back(asset);
+        {
+            std::lock_guard<std::mutex> lock(doneMutex);
+            pending++;
+        }
+        pool.submit([this, asset]
+                    {
+                        {
+                            ProfileScope scope(profiler, "AssetLoader::mesh");
+                            std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+                            //a converted .mbin next to the OBJ is mapped instead of parsing anything
+                            std::string binary = MeshGeometry::binaryName(asset->filename.c_str());
+                            if (access(binary.c_str(), R_OK) == 0)
+                            {
+                                asset->geometry = new MeshGeometry(binary.c_str());
+                                asset->mapped = !asset->geometry->isEmpty();
+                                if (!asset->mapped)
+                                {
+                                    delete asset->geometry;
+                                    asset->geometry = 0;
+                                }
+                            }
+                            if (!asset->geometry)
+                                asset->geometry = new MeshGeometry(asset->filename.c_str());
+                            asset->geometry->buildBVH();
+                            asset->seconds = since(t);
+                        }
+                        completed();
+                    });
+        return asset;
+    }
+
+    //Blocks until every request so far has been decoded or parsed, then parses the skeleton Meshes
+    //that were asked for here, on the calling thread
+    void finish()
+    {
+        ProfileScope scope(profiler, "AssetLoader::finish");
+        wait();
+        for (unsigned int i = 0; i < meshes.size(); i++)
+        {
+            MeshAsset* asset = meshes[i];
+            if (!asset->withMesh || asset->mapped || asset->mesh)
+                continue;
+            std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+            asset->mesh = new Mesh(asset->filename.c_str());
+            asset->seconds += since(t);
+        }
+    }
+
+    std::vector<Image*>& getImages()
+    {
+        return images;
+    }
+
+    //Per-asset times plus the wall clock time of the whole batch
+    void report()
+    {
+        for (unsigned int i = 0; i < images.size(); i++)
+            printf("asset %-40s %s %8.2f ms\n", images[i]->filename.substr(images[i]->filename.find_last_of('/') + 1).c_str(),
+                   images[i]->mips.fromCache ? "cached" : "decode", images[i]->seconds * 1000);
+        for (unsigned int i = 0; i < meshes.size(); i++)
+            printf("asset %-40s parse  %8.2f ms\n", meshes[i]->filename.substr(meshes[i]->filename.find_last_of('/') + 1).c_str(), meshes[i]->seconds * 1000);
+        printf("assets loaded in %.2f ms on %d threads\n", since(start) * 1000, pool.size());
+    }
+};
@@ -0,0 +1,331 @@
+//Microbenchmarks of the simulation and asset loading hot paths, on synthetic headless scenes.
+//  Benchmark [-size N] [-repeat R] [-filter name] [-out results.json] [-assets dir]
+//Every benchmark runs R times and reports the minimum and median time per operation. The results
+//are written as JSON (to stdout without -out) so runs of different builds can be compared.
+//Build: c++ -std=c++11 -O2 Benchmark.cpp -framework OpenGL -framework GLUT
+
+#define HEADLESS
+#define GAME_NO_MAIN
+#include "OpenGLGame.cpp"
+
+#include <functional>
+
+struct BenchmarkResult
+{
+    std::string name;
+    int size;
+    long long operations;       // per run
+    double minNs;               // per operation
+    double medianNs;
+};
+
+//Runs the benchmark repeat times; run() does operations operations and returns nothing useful
+static BenchmarkResult measure(const char* name, int size, long long operations, int repeat, std::function<void()> run)
+{
+    std::vector<double> perOperation;
+    for (int r = 0; r < repeat; r++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        perOperation.push_back(seconds * 1e9 / operations);
+    }
+    std::sort(perOperation.begin(), perOperation.end());
+    BenchmarkResult result;
+    result.name = name;
+    result.size = size;
+    result.operations = operations;
+    result.minNs = perOperation.front();
+    result.medianNs = perOperation[perOperation.size() / 2];
+    fprintf(stderr, "%-24s size %8d  %12.1f ns/op (min %.1f)\n", name, size, result.medianNs, result.minNs);
+    return result;
+}
+
+static float randomIn(float side)
+{
+    return (rand() / (float)RAND_MAX - 0.5f) * side;
+}
+
+//Scene with size trees and size/10 bouncers at the density of the collision benchmark
+static Scene* buildScene(int size)
+{
+    srand(1);
+    Scene* scene = new Scene();
+    scene->initialize(true);
+    float side = sqrtf(size * 60.0f * 60.0f);
+    for (int i = 0; i < size; i++)
+        scene->addTree(float3(randomIn(side), 0, randomIn(side)));
+    for (int i = 0; i < size / 10; i++)
+        scene->addBouncer(float3(randomIn(side), 5, randomIn(side)), float3(randomIn(1), 0, randomIn(1)) * 40);
+    return scene;
+}
+
+int main(int argc, char** argv)
+{
+    int size = 10000;
+    int repeat = 9;
+    const char* filter = 0;
+    const char* output = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+            size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc)
+            repeat = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "-filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (strcmp(argv[i], "-assets") == 0 && i + 1 < argc)
+            assetRoot = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: %s [-size N] [-repeat R] [-filter name] [-out results.json] [-assets dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    profiler.enabled = false;
+    std::vector<BenchmarkResult> results;
+    int failures = 0;           // benchmarks whose results came out wrong or that could not run
+    auto selected = [filter](const char* name) { return !filter || strstr(name, filter); };
+
+    // one Bouncer::move per bouncer and run, in creation order
+    if (selected("bouncer_move"))
+    {
+        Scene* scene = new Scene();
+        scene->initialize(true);
+        srand(1);
+        std::vector<Bouncer*> bouncers;
+        float side = sqrtf(size * 60.0f * 60.0f);
+        for (int i = 0; i < size; i++)
+            bouncers.push_back(scene->addBouncer(float3(randomIn(side), 5, randomIn(side)), float3(randomIn(1), 0, randomIn(1)) * 40));
+        double t = 0;
+        results.push_back(measure("bouncer_move", size, size, repeat, [&]
+                                  {
+                                      for (unsigned int i = 0; i < bouncers.size(); i++)
+                                          bouncers[i]->move(t, 1.0 / 60);
+                                      t += 1.0 / 60;
+                                  }));
+        delete scene;
+    }
+
+    // whole-scene collision passes over size trees and size/10 bouncers
+    if (selected("check_collisions"))
+    {
+        Scene* scene = buildScene(size);
+        const int passes = 100;
+        results.push_back(measure("check_collisions", size, passes, repeat, [&]
+                                  {
+                                      for (int pass = 0; pass < passes; pass++)
+                                          scene->checkCollisions();
+                                  }));
+        delete scene;
+    }
+
+    // bounds queries on trees whose cached world bounds are current, and right after a transform change
+    if (selected("bounds_cached") || selected("bounds_dirty"))
+    {
+        Scene* scene = new Scene();
+        scene->initialize(true);
+        srand(1);
+        std::vector<MeshInstance*> trees;
+        float side = sqrtf(size * 60.0f * 60.0f);
+        for (int i = 0; i < size; i++)
+            trees.push_back(scene->addTree(float3(randomIn(side), 0, randomIn(side))));
+        volatile float sink = 0;
+        if (selected("bounds_cached"))
+            results.push_back(measure("bounds_cached", size, size, repeat, [&]
+                                      {
+                                          float sum = 0;
+                                          for (unsigned int i = 0; i < trees.size(); i++)
+                                              sum += trees[i]->getRadius() + trees[i]->getCenter().x;
+                                          sink = sum;
+                                      }));
+        if (selected("bounds_dirty"))
+            results.push_back(measure("bounds_dirty", size, size, repeat, [&]
+                                      {
+                                          float sum = 0;
+                                          for (unsigned int i = 0; i < trees.size(); i++)
+                                          {
+                                              trees[i]->rotate(0.01f);
+                                              sum += trees[i]->getRadius() + trees[i]->getCenter().x;
+                                          }
+                                          sink = sum;
+                                      }));
+        delete scene;
+    }
+
+    // rays straight down through trees right after they moved, which must hit them where they are now
+    if (selected("instance_ray"))
+    {
+        Scene* scene = new Scene();
+        scene->initialize(true);
+        srand(1);
+        std::vector<MeshInstance*> trees;
+        std::vector<float3> centers;
+        std::vector<float> radii;
+        float side = sqrtf(size * 60.0f * 60.0f);
+        for (int i = 0; i < size; i++)
+        {
+            trees.push_back(scene->addTree(float3(randomIn(side), 0, randomIn(side))));
+            centers.push_back(trees.back()->getCenter());
+            radii.push_back(trees.back()->getRadius());
+        }
+        float shift = 500;
+        int misses = 0;
+        results.push_back(measure("instance_ray", size, size, repeat, [&]
+                                  {
+                                      shift = -shift;
+                                      for (unsigned int i = 0; i < trees.size(); i++)
+                                      {
+                                          trees[i]->translate(float3(0, 0, shift));
+                                          centers[i].z += shift;
+                                          float t;
+                                          if (!trees[i]->intersectRay(centers[i] + float3(0, 2 * radii[i], 0), float3(0, -1, 0), 4 * radii[i], t))
+                                              misses++;
+                                      }
+                                  }));
+        if (misses)
+        {
+            fprintf(stderr, "instance_ray: %d rays missed the trees they were cast at\n", misses);
+            failures++;
+        }
+        delete scene;
+    }
+    
+    // world matrix updates after moving size/10 roots that each carry 9 attached trees
+    if (selected("transforms_update"))
+    {
+        Scene* scene = new Scene();
+        scene->initialize(true);
+        srand(1);
+        std::vector<MeshInstance*> roots;
+        float side = sqrtf(size * 60.0f * 60.0f);
+        for (int i = 0; i < size / 10; i++)
+        {
+            MeshInstance* root = scene->addTree(float3(randomIn(side), 0, randomIn(side)));
+            for (int j = 0; j < 9; j++)
+                scene->addTree(float3(0, 0, 0))->translate(float3(randomIn(20), 0, randomIn(20)))->attachTo(root);
+            roots.push_back(root);
+        }
+        entities.updateTransforms();
+        results.push_back(measure("transforms_update", size, roots.size() * 10, repeat, [&]
+                                  {
+                                      for (unsigned int i = 0; i < roots.size(); i++)
+                                          roots[i]->rotate(0.01f);
+                                      entities.updateTransforms();
+                                  }));
+        delete scene;
+    }
+
+    // OBJ parsing: the Mesh used for immediate mode, then MeshGeometry with deduplication and LODs.
+    // Without the asset they would time a failed open, so they are skipped instead.
+    std::string tree = assetPath("tree.obj");
+    const char* treeBenchmarks[] = { "obj_mesh", "obj_geometry", "bvh_build", "bvh_ray", "bvh_sphere" };
+    bool treeSelected = false;
+    for (unsigned int i = 0; i < sizeof(treeBenchmarks) / sizeof(treeBenchmarks[0]); i++)
+        treeSelected = treeSelected || selected(treeBenchmarks[i]);
+    bool treeLoads = treeSelected && !MeshGeometry(tree.c_str()).isEmpty();
+    for (unsigned int i = 0; treeSelected && !treeLoads && i < sizeof(treeBenchmarks) / sizeof(treeBenchmarks[0]); i++)
+        if (selected(treeBenchmarks[i]))
+        {
+            fprintf(stderr, "%s: skipped, could not load %s\n", treeBenchmarks[i], tree.c_str());
+            failures++;
+        }
+    if (treeLoads && selected("obj_mesh"))
+        results.push_back(measure("obj_mesh", 1, 1, repeat, [&]
+                                  {
+                                      delete new Mesh(tree.c_str());
+                                  }));
+    if (treeLoads && selected("obj_geometry"))
+        results.push_back(measure("obj_geometry", 1, 1, repeat, [&]
+                                  {
+                                      MeshGeometry geometry(tree.c_str());
+                                  }));
+
+    // the tree's triangle BVH: the build at load, then random rays and spheres around the mesh
+    if (treeLoads && (selected("bvh_build") || selected("bvh_ray") || selected("bvh_sphere")))
+    {
+        MeshGeometry geometry(tree.c_str());
+        geometry.buildBVH();
+        if (selected("bvh_build"))
+            results.push_back(measure("bvh_build", geometry.triangleCount(), 1, repeat, [&]
+                                      {
+                                          geometry.buildBVH();
+                                      }));
+        float3 center = (geometry.boundsMin + geometry.boundsMax) * 0.5;
+        float side = geometry.boundsRadius * 2;
+        const int queries = 10000;
+        srand(1);
+        std::vector<float3> points, directions;
+        for (int i = 0; i < queries; i++)
+        {
+            points.push_back(center + float3(randomIn(side), randomIn(side), randomIn(side)));
+            directions.push_back(float3(randomIn(1), randomIn(1), randomIn(1)));
+        }
+        volatile int sink = 0;
+        if (selected("bvh_ray"))
+            results.push_back(measure("bvh_ray", geometry.triangleCount(), queries, repeat, [&]
+                                      {
+                                          int hits = 0;
+                                          TriangleBVH::Hit hit;
+                                          for (int i = 0; i < queries; i++)
+                                              hits += geometry.bvh.intersectRay(points[i], directions[i], side * 4, hit);
+                                          sink = hits;
+                                      }));
+        if (selected("bvh_sphere"))
+            results.push_back(measure("bvh_sphere", geometry.triangleCount(), queries, repeat, [&]
+                                      {
+                                          int hits = 0;
+                                          for (int i = 0; i < queries; i++)
+                                              hits += geometry.bvh.intersectsSphere(points[i], side * 0.05f);
+                                          sink = hits;
+                                      }));
+    }
+
+    // PNG decoding alone, and with the mip chain built on top
+    std::string image = assetPath("tigger.png");
+    int imageWidth, imageHeight, imageComponents;
+    unsigned char* imagePixels = stbi_load(image.c_str(), &imageWidth, &imageHeight, &imageComponents, 4);
+    bool imageLoads = imagePixels != 0;
+    stbi_image_free(imagePixels);
+    const char* imageBenchmarks[] = { "png_decode", "png_mip_chain" };
+    for (unsigned int i = 0; !imageLoads && i < sizeof(imageBenchmarks) / sizeof(imageBenchmarks[0]); i++)
+        if (selected(imageBenchmarks[i]))
+        {
+            fprintf(stderr, "%s: skipped, could not load %s\n", imageBenchmarks[i], image.c_str());
+            failures++;
+        }
+    if (imageLoads && selected("png_decode"))
+        results.push_back(measure("png_decode", 1, 1, repeat, [&]
+                                  {
+                                      int width, height, components;
+                                      stbi_image_free(stbi_load(image.c_str(), &width, &height, &components, 4));
+                                  }));
+    if (imageLoads && selected("png_mip_chain"))
+        results.push_back(measure("png_mip_chain", 1, 1, repeat, [&]
+                                  {
+                                      int width, height, components;
+                                      unsigned char* pixels = stbi_load(image.c_str(), &width, &height, &components, 4);
+                                      MipChain mips;
+                                      if (pixels)
+                                          mips.build(pixels, width, height, 4);
+                                      stbi_image_free(pixels);
+                                  }));
+
+    FILE* file = output ? fopen(output, "w") : stdout;
+    if (!file)
+    {
+        fprintf(stderr, "could not write %s\n", output);
+        return 1;
+    }
+    fprintf(file, "{\n  \"repeat\": %d,\n  \"benchmarks\": [\n", repeat);
+    for (unsigned int i = 0; i < results.size(); i++)
+        fprintf(file, "    {\"name\": \"%s\", \"size\": %d, \"operations\": %lld, \"min_ns\": %.1f, \"median_ns\": %.1f}%s\n",
+                results[i].name.c_str(), results[i].size, results[i].operations, results[i].minNs, results[i].medianNs,
+                i + 1 < results.size() ? "," : "");
+    fprintf(file, "  ]\n}\n");
+    if (output)
+        fclose(file);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+#include "float3.h"
+#include "Frustum.h"
+
+//Bounding volume hierarchy over bounding spheres, for frustum culling of static scenery.
+//Built top down by splitting at the median center along the longest axis; a frustum query
+//skips whole subtrees outside the view and accepts whole subtrees inside it without testing
+//their spheres, so its cost follows the visible set rather than the scene size.
+class CullingBVH
+{
+public:
+    struct Item
+    {
+        float3 center;
+        float radius;
+        unsigned int id;
+    };
+
+private:
+    struct Node
+    {
+        float3 min;
+        float3 max;
+        int left;               // child nodes, -1 for leaves
+        int right;
+        unsigned int first;     // items of the subtree are items[first, first + count)
+        unsigned int count;
+    };
+
+    static const unsigned int leafSize = 4;
+
+    std::vector<Node> nodes;
+    std::vector<Item> items;
+
+    struct CenterLess
+    {
+        int axis;
+        bool operator()(const Item& a, const Item& b) const
+        {
+            return axis == 0 ? a.center.x < b.center.x : axis == 1 ? a.center.y < b.center.y : a.center.z < b.center.z;
+        }
+    };
+
+    int build(unsigned int first, unsigned int count)
+    {
+        Node node;
+        node.first = first;
+        node.count = count;
+        node.left = node.right = -1;
+        node.min = items[first].center - float3(1,1,1) * items[first].radius;
+        node.max = items[first].center + float3(1,1,1) * items[first].radius;
+        float3 centerMin = items[first].center;
+        float3 centerMax = items[first].center;
+        for (unsigned int i = first + 1; i < first + count; i++)
+        {
+            float3 c = items[i].center;
+            float r = items[i].radius;
+            node.min = float3(fminf(node.min.x, c.x - r), fminf(node.min.y, c.y - r), fminf(node.min.z, c.z - r));
+            node.max = float3(fmaxf(node.max.x, c.x + r), fmaxf(node.max.y, c.y + r), fmaxf(node.max.z, c.z + r));
+            centerMin = float3(fminf(centerMin.x, c.x), fminf(centerMin.y, c.y), fminf(centerMin.z, c.z));
+            centerMax = float3(fmaxf(centerMax.x, c.x), fmaxf(centerMax.y, c.y), fmaxf(centerMax.z, c.z));
+        }
+        int index = nodes.size();
+        nodes.push_back(node);
+        if (count <= leafSize)
+            return index;
+
+        float3 extent = centerMax - centerMin;
+        CenterLess less;
+        less.axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+        unsigned int half = count / 2;
+        std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count, less);
+        int left = build(first, half);
+        int right = build(first + half, count - half);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        return index;
+    }
+
+public:
+    void build(const std::vector<Item>& spheres)
+    {
+        items = spheres;
+        nodes.clear();
+        if (!items.empty())
+            build(0, items.size());
+    }
+
+    void clear()
+    {
+        items.clear();
+        nodes.clear();
+    }
+
+    unsigned int size()
+    {
+        return items.size();
+    }
+
+    //Appends the ids of all spheres intersecting the frustum; returns the number of node and sphere tests
+    int cull(const Frustum& frustum, std::vector<unsigned int>& visible)
+    {
+        int tests = 0;
+        if (nodes.empty())
+            return tests;
+        int stack[64];
+        int depth = 0;
+        stack[depth++] = 0;
+        while (depth > 0)
+        {
+            const Node& node = nodes[stack[--depth]];
+            tests++;
+            Frustum::Containment containment = frustum.classifyBox(node.min, node.max);
+            if (containment == Frustum::outside)
+                continue;
+            if (containment == Frustum::inside)
+            {
+                for (unsigned int i = node.first; i < node.first + node.count; i++)
+                    visible.push_back(items[i].id);
+            }
+            else if (node.left < 0)
+            {
+                for (unsigned int i = node.first; i < node.first + node.count; i++)
+                {
+                    tests++;
+                    if (frustum.intersectsSphere(items[i].center, items[i].radius))
+                        visible.push_back(items[i].id);
+                }
+            }
+            else
+            {
+                stack[depth++] = node.left;
+                stack[depth++] = node.right;
+            }
+        }
+        return tests;
+    }
+};
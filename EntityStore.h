@@ -0,0 +1,518 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "float3.h"
+#include "Heightfield.h"
+
+class Material;
+class Mesh;
+class MeshGeometry;
+class Object;
+
+//Structure-of-arrays storage for per-entity state.
+//Every Object owns one entity slot (transform + render handles); Bouncers also own a body slot
+//holding their dynamics. Systems walk these arrays directly instead of calling virtuals per object.
+//Transforms are local to the entity's parent, if it has one. Their world matrices are cached and only
+//rebuilt by updateTransforms(), for entities marked dirty and everything attached below them.
+class EntityStore
+{
+public:
+    //transforms, indexed by entity
+    std::vector<float3> position;
+    std::vector<float3> scaleFactor;
+    std::vector<float3> orientationAxis;
+    std::vector<float> orientationAngle;
+    std::vector<unsigned char> transformDirty;      // local transform edited since the last updateTransforms()
+    std::vector<unsigned char> transformChanged;    // world matrix rebuilt since the owner last looked (bounds caches)
+
+    //transform hierarchy, indexed by entity; -1 for none
+    std::vector<int> parent;
+    std::vector<int> firstChild;
+    std::vector<int> nextSibling;
+
+    //cached world transform: 16 floats per entity, column-major as glMultMatrixf takes them, and the
+    //largest scale along any of its axes, for bounding spheres
+    std::vector<float> worldMatrix;
+    std::vector<float> worldScale;
+
+    //render handles, indexed by entity
+    std::vector<Material*> material;
+    std::vector<Mesh*> mesh;            // drawn directly when set, otherwise owner->drawModel()
+    std::vector<MeshGeometry*> geometry; // buffer object version of mesh, preferred when set
+    std::vector<unsigned char> lod;     // geometry level of detail drawn this frame
+    std::vector<Object*> owner;
+    std::vector<unsigned char> castsShadow;
+    std::vector<unsigned char> alive;
+    std::vector<int> bodyOf;            // body slot, or -1 for static entities
+
+    //local space bounding sphere used for culling; radius < 0 means unbounded, never culled
+    std::vector<float3> sphereCenter;
+    std::vector<float> sphereRadius;
+
+    //bumped whenever a static entity appears, disappears, moves or changes bounds, so structures
+    //built over static entities (the culling BVH) know when to rebuild
+    unsigned int staticsVersion = 0;
+
+    //bodies further than this from the origin are put back at it
+    float resetDistance = 1000;
+
+    //the ground bodies bounce off and rest on; flat at y=0 without one
+    const Heightfield* ground = 0;
+
+    //dynamics, indexed by body; kept dense so integration is one linear pass
+    std::vector<unsigned int> bodyEntity;
+    std::vector<float3> velocity;
+    std::vector<float3> acceleration;
+    std::vector<float> angularVelocity;
+    std::vector<float> angularAcceleration;
+    std::vector<float> restitution;
+    std::vector<float3> previousPosition;   // where integrate() found the body, the start of its swept path
+
+private:
+    std::vector<unsigned int> freeEntities;
+    std::vector<unsigned int> dirtyTransforms;      // entities without a body marked dirty; bodies are found by their flag
+    std::vector<unsigned char> transformQueued;     // on dirtyTransforms already, even if updated since
+    unsigned int attachedCount = 0;                 // entities with a parent; none means every world matrix is a local one
+
+    //Column-major local matrix of entity e: scale, then rotation about its axis, then translation
+    void composeLocal(unsigned int e, float* m) const
+    {
+        float3 t = position[e];
+        float3 axis = orientationAxis[e].normalize();
+        float3 s = scaleFactor[e];
+        float angle = orientationAngle[e] * 3.14159265f / 180;
+        float c = cosf(angle);
+        float sn = sinf(angle);
+        float k = 1 - c;
+        m[0] = (axis.x*axis.x*k + c) * s.x;        m[1] = (axis.y*axis.x*k + axis.z*sn) * s.x; m[2] = (axis.x*axis.z*k - axis.y*sn) * s.x;  m[3] = 0;
+        m[4] = (axis.x*axis.y*k - axis.z*sn) * s.y; m[5] = (axis.y*axis.y*k + c) * s.y;        m[6] = (axis.y*axis.z*k + axis.x*sn) * s.y;  m[7] = 0;
+        m[8] = (axis.x*axis.z*k + axis.y*sn) * s.z; m[9] = (axis.y*axis.z*k - axis.x*sn) * s.z; m[10] = (axis.z*axis.z*k + c) * s.z;        m[11] = 0;
+        m[12] = t.x;                                m[13] = t.y;                                m[14] = t.z;                               m[15] = 1;
+    }
+
+    //out = a * b for column-major affine matrices (bottom rows 0 0 0 1); out may not alias either
+    static void multiplyAffine(const float* a, const float* b, float* out)
+    {
+#ifdef __SSE2__
+        __m128 a0 = _mm_loadu_ps(a), a1 = _mm_loadu_ps(a + 4), a2 = _mm_loadu_ps(a + 8), a3 = _mm_loadu_ps(a + 12);
+        for (int column = 0; column < 4; column++)
+        {
+            const float* c = b + 4 * column;
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(c[0])), _mm_mul_ps(a1, _mm_set1_ps(c[1]))),
+                                  _mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(c[2])), _mm_mul_ps(a3, _mm_set1_ps(c[3]))));
+            _mm_storeu_ps(out + 4 * column, r);
+        }
+#else
+        for (int column = 0; column < 4; column++)
+            for (int row = 0; row < 4; row++)
+                out[4 * column + row] = a[row] * b[4 * column] + a[4 + row] * b[4 * column + 1]
+                    + a[8 + row] * b[4 * column + 2] + a[12 + row] * b[4 * column + 3];
+#endif
+    }
+
+    void finishTransform(unsigned int e)
+    {
+        const float* m = &worldMatrix[16 * e];
+        float x = m[0]*m[0] + m[1]*m[1] + m[2]*m[2];
+        float y = m[4]*m[4] + m[5]*m[5] + m[6]*m[6];
+        float z = m[8]*m[8] + m[9]*m[9] + m[10]*m[10];
+        worldScale[e] = sqrtf(std::max(x, std::max(y, z)));
+        transformDirty[e] = 0;
+        transformChanged[e] = 1;
+    }
+
+    //Rebuilds e's world matrix from its parent's, then everything attached below it
+    void updateSubtree(unsigned int e)
+    {
+        float* world = &worldMatrix[16 * e];
+        if (parent[e] < 0)
+            composeLocal(e, world);
+        else
+        {
+            float local[16];
+            composeLocal(e, local);
+            multiplyAffine(&worldMatrix[16 * parent[e]], local, world);
+        }
+        finishTransform(e);
+        for (int child = firstChild[e]; child >= 0; child = nextSibling[child])
+            updateSubtree(child);
+    }
+
+    int depth(unsigned int e) const
+    {
+        int d = 0;
+        for (int p = parent[e]; p >= 0; p = parent[p])
+            d++;
+        return d;
+    }
+
+public:
+    unsigned int createEntity(Object* object, Material* m)
+    {
+        unsigned int e;
+        if (!freeEntities.empty())
+        {
+            e = freeEntities.back();
+            freeEntities.pop_back();
+        }
+        else
+        {
+            e = position.size();
+            position.push_back(float3());
+            scaleFactor.push_back(float3());
+            orientationAxis.push_back(float3());
+            orientationAngle.push_back(0);
+            transformDirty.push_back(0);
+            transformQueued.push_back(0);
+            transformChanged.push_back(0);
+            parent.push_back(-1);
+            firstChild.push_back(-1);
+            nextSibling.push_back(-1);
+            worldMatrix.resize(worldMatrix.size() + 16);
+            worldScale.push_back(1);
+            material.push_back(0);
+            mesh.push_back(0);
+            geometry.push_back(0);
+            lod.push_back(0);
+            owner.push_back(0);
+            castsShadow.push_back(0);
+            alive.push_back(0);
+            bodyOf.push_back(-1);
+            sphereCenter.push_back(float3());
+            sphereRadius.push_back(-1);
+        }
+        position[e] = float3(0,0,0);
+        scaleFactor[e] = float3(1,1,1);
+        orientationAxis[e] = float3(0,1,0);
+        orientationAngle[e] = 0;
+        transformDirty[e] = 0;
+        transformChanged[e] = 1;
+        parent[e] = firstChild[e] = nextSibling[e] = -1;
+        material[e] = m;
+        mesh[e] = 0;
+        geometry[e] = 0;
+        lod[e] = 0;
+        owner[e] = object;
+        castsShadow[e] = 1;
+        alive[e] = 1;
+        bodyOf[e] = -1;
+        sphereCenter[e] = float3(0,0,0);
+        sphereRadius[e] = -1;
+        markTransformDirty(e);
+        staticsVersion++;
+        return e;
+    }
+
+    void destroyEntity(unsigned int e)
+    {
+        if (bodyOf[e] >= 0)
+            destroyBody(e);
+        // children become roots, their local transforms now taken in world space
+        while (firstChild[e] >= 0)
+            detach(firstChild[e]);
+        if (parent[e] >= 0)
+            detach(e);
+        alive[e] = 0;
+        owner[e] = 0;
+        freeEntities.push_back(e);
+        staticsVersion++;
+        // once the last entity is gone ids start over, so a reloaded level numbers its entities
+        // the way the first load did; the arrays keep their capacity
+        if (freeEntities.size() == alive.size())
+        {
+            freeEntities.clear();
+            position.clear();
+            scaleFactor.clear();
+            orientationAxis.clear();
+            orientationAngle.clear();
+            transformDirty.clear();
+            transformQueued.clear();
+            transformChanged.clear();
+            parent.clear();
+            firstChild.clear();
+            nextSibling.clear();
+            worldMatrix.clear();
+            worldScale.clear();
+            dirtyTransforms.clear();
+            material.clear();
+            mesh.clear();
+            geometry.clear();
+            lod.clear();
+            owner.clear();
+            castsShadow.clear();
+            alive.clear();
+            bodyOf.clear();
+            sphereCenter.clear();
+            sphereRadius.clear();
+        }
+    }
+
+    //Call after editing e's position, scale or orientation. Only for the main thread; the physics
+    //threads set the dirty flag of their bodies directly, which updateTransforms() also looks at.
+    void markTransformDirty(unsigned int e)
+    {
+        transformDirty[e] = 1;
+        if (bodyOf[e] < 0 && !transformQueued[e])
+        {
+            transformQueued[e] = 1;
+            dirtyTransforms.push_back(e);
+        }
+    }
+
+    //Makes e's transform relative to newParent's; detaches it from any parent it had
+    void attach(unsigned int e, unsigned int newParent)
+    {
+        if (parent[e] >= 0)
+            detach(e);
+        parent[e] = newParent;
+        nextSibling[e] = firstChild[newParent];
+        firstChild[newParent] = e;
+        attachedCount++;
+        markTransformDirty(e);
+    }
+
+    //Makes e a root again; its local transform is then taken in world space
+    void detach(unsigned int e)
+    {
+        int p = parent[e];
+        if (p < 0)
+            return;
+        int* link = &firstChild[p];
+        while (*link != (int)e)
+            link = &nextSibling[*link];
+        *link = nextSibling[e];
+        parent[e] = nextSibling[e] = -1;
+        attachedCount--;
+        markTransformDirty(e);
+    }
+
+    //True if e is neither attached to anything nor has anything attached to it
+    bool isLone(unsigned int e) const
+    {
+        return parent[e] < 0 && firstChild[e] < 0;
+    }
+
+    bool hasAttachments() const
+    {
+        return attachedCount > 0;
+    }
+
+    //True if neither e nor anything it hangs from is a body, so it only moves when edited
+    bool isStatic(unsigned int e) const
+    {
+        for (int p = e; p >= 0; p = parent[p])
+            if (bodyOf[p] >= 0)
+                return false;
+        return true;
+    }
+
+    //Rebuilds the world matrices of the entities marked dirty and of everything attached below them.
+    //Nothing marked costs nothing, apart from a look at each body's flag. Without any attachments the
+    //dirty entities' matrices are composed in one straight pass over their transform arrays; otherwise
+    //they are sorted so parents are done before their children.
+    void updateTransforms()
+    {
+        for (unsigned int b = 0; b < bodyEntity.size(); b++)
+            if (transformDirty[bodyEntity[b]])
+                dirtyTransforms.push_back(bodyEntity[b]);
+        if (dirtyTransforms.empty())
+            return;
+        if (attachedCount == 0)
+        {
+            for (unsigned int i = 0; i < dirtyTransforms.size(); i++)
+            {
+                unsigned int e = dirtyTransforms[i];
+                if (!alive[e] || !transformDirty[e])
+                    continue;
+                composeLocal(e, &worldMatrix[16 * e]);
+                finishTransform(e);
+            }
+        }
+        else
+        {
+            std::vector<std::pair<int, unsigned int> > ordered;
+            ordered.reserve(dirtyTransforms.size());
+            for (unsigned int i = 0; i < dirtyTransforms.size(); i++)
+                ordered.push_back(std::make_pair(depth(dirtyTransforms[i]), dirtyTransforms[i]));
+            std::sort(ordered.begin(), ordered.end());
+            // a dirty entity below another one was already redone with its ancestor's subtree
+            for (unsigned int i = 0; i < ordered.size(); i++)
+            {
+                unsigned int e = ordered[i].second;
+                if (alive[e] && transformDirty[e])
+                    updateSubtree(e);
+            }
+        }
+        for (unsigned int i = 0; i < dirtyTransforms.size(); i++)
+            transformQueued[dirtyTransforms[i]] = 0;
+        dirtyTransforms.clear();
+    }
+
+    //Brings only e's world matrix up to date, along with whatever hangs from the same dirty ancestor;
+    //for reading one entity between full updates. For a lone entity this writes nothing but its own
+    //slot, so the physics threads may call it on the bodies they own.
+    void updateTransform(unsigned int e)
+    {
+        int top = -1;
+        for (int p = e; p >= 0; p = parent[p])
+            if (transformDirty[p])
+                top = p;
+        if (top >= 0)
+            updateSubtree(top);
+    }
+
+    //Where e is in the world, and a model space point of e in world space; both from the cached matrix
+    float3 worldPosition(unsigned int e) const
+    {
+        const float* m = &worldMatrix[16 * e];
+        return float3(m[12], m[13], m[14]);
+    }
+
+    float3 transformPoint(unsigned int e, float3 p) const
+    {
+        const float* m = &worldMatrix[16 * e];
+        return float3(m[0]*p.x + m[4]*p.y + m[8]*p.z + m[12],
+                      m[1]*p.x + m[5]*p.y + m[9]*p.z + m[13],
+                      m[2]*p.x + m[6]*p.y + m[10]*p.z + m[14]);
+    }
+
+    void setBoundingSphere(unsigned int e, float3 center, float radius)
+    {
+        sphereCenter[e] = center;
+        sphereRadius[e] = radius;
+        staticsVersion++;
+    }
+
+    int createBody(unsigned int e)
+    {
+        int b = bodyEntity.size();
+        bodyEntity.push_back(e);
+        velocity.push_back(float3(0,0,0));
+        acceleration.push_back(float3(0,0,0));
+        angularVelocity.push_back(0);
+        angularAcceleration.push_back(0);
+        restitution.push_back(0.95);
+        previousPosition.push_back(position[e]);
+        bodyOf[e] = b;
+        staticsVersion++;
+        return b;
+    }
+
+    //Swap-removes the body so the dynamics arrays stay dense
+    void destroyBody(unsigned int e)
+    {
+        int b = bodyOf[e];
+        int last = bodyEntity.size()-1;
+        bodyEntity[b] = bodyEntity[last];
+        velocity[b] = velocity[last];
+        acceleration[b] = acceleration[last];
+        angularVelocity[b] = angularVelocity[last];
+        angularAcceleration[b] = angularAcceleration[last];
+        restitution[b] = restitution[last];
+        previousPosition[b] = previousPosition[last];
+        bodyOf[bodyEntity[b]] = b;
+        bodyEntity.pop_back();
+        velocity.pop_back();
+        acceleration.pop_back();
+        angularVelocity.pop_back();
+        angularAcceleration.pop_back();
+        restitution.pop_back();
+        previousPosition.pop_back();
+        bodyOf[e] = -1;
+        staticsVersion++;
+    }
+
+    void resetBody(int b)
+    {
+        unsigned int e = bodyEntity[b];
+        velocity[b] = float3(0,0,0);
+        angularVelocity[b] = 0;
+        angularAcceleration[b] = 0;
+        acceleration[b] = float3(0,0,0);
+        position[e] = float3(0,0,0);
+        previousPosition[b] = position[e];
+        orientationAngle[e] = 0;
+        transformDirty[e] = 1;
+    }
+
+    float groundHeight(float x, float z) const
+    {
+        return ground ? ground->height(x, z) : 0;
+    }
+
+    //Bouncer physics for bodies [begin, end): explicit Euler with a bouncy ground, exponential
+    //damping, and a reset when a body strays further than resetDistance from the origin. Bodies
+    //resting on the ground follow it up and down slopes; bodies moving into it bounce off.
+    void integrate(double dt, int begin, int end)
+    {
+        double angularDamping = pow(0.5, dt);
+        float linearDamping = pow(0.2, dt);
+        for (int b = begin; b<end; b++)
+        {
+            unsigned int e = bodyEntity[b];
+            float3 v = velocity[b] + acceleration[b] * dt;
+            float3 p = position[e];
+            previousPosition[b] = p;
+            bool resting = p.y <= groundHeight(p.x, p.z) + 0.01f && v.y <= 0;
+            p = p + v * dt;
+            float ground = groundHeight(p.x, p.z);
+            if (p.y < ground || resting)
+            {
+                if (p.y < ground && v.y < 0)
+                    v.y *= -restitution[b];
+                p.y = ground;
+            }
+            position[e] = p;
+
+            angularVelocity[b] += angularAcceleration[b] * dt;
+            angularVelocity[b] *= angularDamping;
+            v *= linearDamping;
+            velocity[b] = v;
+
+            orientationAngle[e] += angularVelocity[b] * dt;
+            transformDirty[e] = 1;
+            if (position[e].norm() > resetDistance)
+                resetBody(b);
+        }
+    }
+
+    void integrate(double dt)
+    {
+        integrate(dt, 0, bodyEntity.size());
+    }
+
+    //FNV-1a over the exact bits of every live transform and body, to compare simulation runs
+    unsigned long long hashState()
+    {
+        unsigned long long hash = 14695981039346656037ULL;
+        for (unsigned int e = 0; e < alive.size(); e++)
+        {
+            if (!alive[e])
+                continue;
+            float state[8] = {position[e].x, position[e].y, position[e].z, orientationAngle[e],
+                              scaleFactor[e].x, scaleFactor[e].y, scaleFactor[e].z, (float)e};
+            hash = hashBytes(hash, state, sizeof(state));
+        }
+        for (unsigned int b = 0; b < bodyEntity.size(); b++)
+        {
+            float state[5] = {velocity[b].x, velocity[b].y, velocity[b].z, angularVelocity[b], (float)bodyEntity[b]};
+            hash = hashBytes(hash, state, sizeof(state));
+        }
+        return hash;
+    }
+
+    static unsigned long long hashBytes(unsigned long long hash, const void* data, unsigned int size)
+    {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (unsigned int i = 0; i < size; i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        return hash;
+    }
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <math.h>
+
+#include "float3.h"
+
+//The six planes of a perspective view volume, normals pointing inwards:
+//a point p is inside a plane when normal.dot(p) + distance >= 0
+class Frustum
+{
+public:
+    enum Containment { outside, intersecting, inside };
+
+    float3 normal[6];
+    float distance[6];
+
+    //Same parameters as gluPerspective + gluLookAt; fovy in radians
+    void set(float3 eye, float3 lookAt, float3 up, float fovy, float aspect, float nearPlane, float farPlane)
+    {
+        float3 forward = (lookAt - eye).normalize();
+        float3 right = forward.cross(up).normalize();
+        float3 trueUp = right.cross(forward);
+        float halfHeight = tanf(fovy * 0.5f);
+        float halfWidth = halfHeight * aspect;
+
+        setPlane(0, forward, eye + forward * nearPlane);
+        setPlane(1, forward * -1, eye + forward * farPlane);
+        //side planes pass through the eye, each perpendicular to one edge direction of the view volume
+        setPlane(2, (right + forward * halfWidth).normalize(), eye);
+        setPlane(3, (right * -1 + forward * halfWidth).normalize(), eye);
+        setPlane(4, (trueUp + forward * halfHeight).normalize(), eye);
+        setPlane(5, (trueUp * -1 + forward * halfHeight).normalize(), eye);
+    }
+
+    bool intersectsSphere(float3 center, float radius) const
+    {
+        for (int i = 0; i < 6; i++)
+            if (normal[i].dot(center) + distance[i] < -radius)
+                return false;
+        return true;
+    }
+
+    //Conservative: boxes near a frustum corner may be reported intersecting while outside
+    Containment classifyBox(float3 min, float3 max) const
+    {
+        Containment result = inside;
+        for (int i = 0; i < 6; i++)
+        {
+            //box corners furthest along and against the plane normal
+            float3 n = normal[i];
+            float3 positive(n.x >= 0 ? max.x : min.x, n.y >= 0 ? max.y : min.y, n.z >= 0 ? max.z : min.z);
+            float3 negative(n.x >= 0 ? min.x : max.x, n.y >= 0 ? min.y : max.y, n.z >= 0 ? min.z : max.z);
+            if (n.dot(positive) + distance[i] < 0)
+                return outside;
+            if (n.dot(negative) + distance[i] < 0)
+                result = intersecting;
+        }
+        return result;
+    }
+
+private:
+    void setPlane(int i, float3 n, float3 point)
+    {
+        normal[i] = n;
+        distance[i] = -n.dot(point);
+    }
+};
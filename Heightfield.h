@@ -0,0 +1,313 @@
+#pragma once
+
+#include <atomic>
+#include <math.h>
+#include <stdint.h>
+
+#include "float3.h"
+
+//Ground heights on an unbounded square grid, sample (i, j) at x = i * spacing, z = j * spacing.
+//Heights are value noise, so any sample can be worked out on its own from its position. They are
+//kept in tiles of tileQuads x tileQuads cells, made the first time anything asks for one of their
+//samples (from any thread), and dropped again by update() once nothing has asked for a while, so
+//memory follows where the bodies and the camera are rather than the size of the world. height()
+//interpolates over the same two triangles per grid cell the terrain chunks are drawn with, so
+//bodies rest on the surface that is on screen (at the finest level of detail).
+class Heightfield
+{
+public:
+    static const int tileQuads = 32;        // the same as Terrain::chunkQuads, a chunk reads one tile
+
+private:
+    static const int tileSamples = tileQuads + 1;   // neighbouring tiles both keep their shared edge
+    static const unsigned int minSlots = 1024;
+
+    struct Tile
+    {
+        long long key;
+        std::atomic<unsigned int> lastUsed;
+        float heights[tileSamples * tileSamples];
+    };
+
+    float spacing;          // world units between samples
+    float inverseSpacing;
+    float amplitude;
+    float flatRadius;
+    float flatInside;       // squared distance from the origin within which every cell is flat
+    float scale;            // amplitude over the total weight of the octaves
+    uint32_t seed;
+
+    //Open addressing with linear probing. Lookups and inserts are lock free, so the physics threads
+    //can make the tiles they land on; slots are only emptied, and the table only grown, by update().
+    mutable std::atomic<Tile*>* slots;
+    unsigned int slotMask;
+    mutable std::atomic<unsigned int> tileCount;
+    unsigned int clock;
+
+    //Repeatable pseudo random value in [-1, 1] for a lattice point
+    static float lattice(int x, int z, uint32_t seed)
+    {
+        uint32_t h = (uint32_t)x * 374761393u + (uint32_t)z * 668265263u + seed * 2246822519u;
+        h = (h ^ (h >> 13)) * 1274126177u;
+        h ^= h >> 16;
+        return h * (2.0f / 4294967295.0f) - 1;
+    }
+
+    static int floorDiv(int i)
+    {
+        return i >= 0 ? i / tileQuads : -((-i + tileQuads - 1) / tileQuads);
+    }
+
+    static long long tileKey(int tileX, int tileZ)
+    {
+        return (long long)(((unsigned long long)(unsigned int)tileX << 32) | (unsigned int)tileZ);
+    }
+
+    static unsigned int slotOf(long long key, unsigned int mask)
+    {
+        return (unsigned int)(((unsigned long long)key * 11400714819323198485ull) >> 32) & mask;
+    }
+
+    //Rolling hills: octaves of value noise from 1024 down to 32 world units, at most amplitude
+    //high, flat within flatRadius of the origin and rising to full height at twice that. Tiles and
+    //lookups that miss both come here, so a height never depends on which of them made it.
+    float sampleAt(int i, int j) const
+    {
+        float x = i * spacing;
+        float z = j * spacing;
+        float r = sqrtf(x * x + z * z);
+        float rise = flatRadius > 0 ? fminf(fmaxf(r / flatRadius - 1, 0), 1) : 1;
+        if (rise == 0 || amplitude == 0)
+            return 0;
+        rise = rise * rise * (3 - 2 * rise);
+        float h = 0;
+        float weight = 1;
+        for (float wavelength = 1024; wavelength >= 32; wavelength *= 0.5f, weight *= 0.5f)
+        {
+            uint32_t octaveSeed = seed + (uint32_t)wavelength;
+            float fx = floorf(x / wavelength);
+            float fz = floorf(z / wavelength);
+            float u = x / wavelength - fx;
+            float v = z / wavelength - fz;
+            u = u * u * (3 - 2 * u);
+            v = v * v * (3 - 2 * v);
+            int cx = (int)fx;
+            int cz = (int)fz;
+            float a = lattice(cx, cz, octaveSeed), b = lattice(cx + 1, cz, octaveSeed);
+            float c = lattice(cx, cz + 1, octaveSeed), d = lattice(cx + 1, cz + 1, octaveSeed);
+            h += (a + (b - a) * u + (c - a) * v + (a - b - c + d) * u * v) * weight;
+        }
+        return h * (scale * rise);
+    }
+
+    Tile* makeTile(int tileX, int tileZ) const
+    {
+        Tile* tile = new Tile();
+        tile->key = tileKey(tileX, tileZ);
+        tile->lastUsed.store(clock, std::memory_order_relaxed);
+        for (int j = 0; j < tileSamples; j++)
+            for (int i = 0; i < tileSamples; i++)
+                tile->heights[j * tileSamples + i] = sampleAt(tileX * tileQuads + i, tileZ * tileQuads + j);
+        return tile;
+    }
+
+    //The tile, made now if nobody has yet; 0 only if the table is too full to take it before the
+    //next update(), and then the caller works the samples out itself
+    const Tile* tile(int tileX, int tileZ) const
+    {
+        long long key = tileKey(tileX, tileZ);
+        unsigned int slot = slotOf(key, slotMask);
+        for (unsigned int probe = 0; probe <= slotMask; probe++, slot = (slot + 1) & slotMask)
+        {
+            Tile* found = slots[slot].load(std::memory_order_acquire);
+            if (!found)
+            {
+                if (tileCount.load(std::memory_order_relaxed) * 2 > slotMask)
+                    return 0;
+                Tile* made = makeTile(tileX, tileZ);
+                if (slots[slot].compare_exchange_strong(found, made, std::memory_order_acq_rel))
+                {
+                    tileCount.fetch_add(1, std::memory_order_relaxed);
+                    return made;
+                }
+                // another thread filled the slot first, maybe with this very tile
+                delete made;
+            }
+            if (found->key == key)
+            {
+                if (found->lastUsed.load(std::memory_order_relaxed) != clock)
+                    found->lastUsed.store(clock, std::memory_order_relaxed);
+                return found;
+            }
+        }
+        return 0;
+    }
+
+    //Puts the tiles into a fresh table of slotCount slots, dropping those rejected by keep
+    template<typename Keep>
+    void rehash(unsigned int slotCount, Keep keep)
+    {
+        std::atomic<Tile*>* old = slots;
+        unsigned int oldCount = old ? slotMask + 1 : 0;
+        slots = new std::atomic<Tile*>[slotCount];
+        for (unsigned int s = 0; s < slotCount; s++)
+            slots[s].store(0, std::memory_order_relaxed);
+        slotMask = slotCount - 1;
+        unsigned int count = 0;
+        for (unsigned int s = 0; s < oldCount; s++)
+        {
+            Tile* tile = old[s].load(std::memory_order_relaxed);
+            if (!tile)
+                continue;
+            if (!keep(tile))
+            {
+                delete tile;
+                continue;
+            }
+            unsigned int slot = slotOf(tile->key, slotMask);
+            while (slots[slot].load(std::memory_order_relaxed))
+                slot = (slot + 1) & slotMask;
+            slots[slot].store(tile, std::memory_order_relaxed);
+            count++;
+        }
+        tileCount.store(count, std::memory_order_relaxed);
+        delete[] old;
+    }
+
+    struct KeepAll
+    {
+        bool operator()(const Tile*) const { return true; }
+    };
+
+    struct KeepRecent
+    {
+        unsigned int clock;
+        unsigned int keepTicks;
+        bool operator()(const Tile* tile) const { return clock - tile->lastUsed.load(std::memory_order_relaxed) <= keepTicks; }
+    };
+
+    struct KeepNone
+    {
+        bool operator()(const Tile*) const { return false; }
+    };
+
+    Heightfield(const Heightfield&);
+    Heightfield& operator=(const Heightfield&);
+
+public:
+    Heightfield():spacing(1),inverseSpacing(1),amplitude(0),flatRadius(0),flatInside(0),scale(0),seed(0),slots(0),slotMask(0),tileCount(0),clock(0)
+    {
+        rehash(minSlots, KeepAll());
+    }
+
+    ~Heightfield()
+    {
+        for (unsigned int s = 0; s <= slotMask; s++)
+            delete slots[s].load(std::memory_order_relaxed);
+        delete[] slots;
+    }
+
+    //Hills at most amplitude high with their lattice every spacing units, flat within flatRadius
+    //of the origin; drops every tile made so far. Only while no other thread reads the field.
+    void configure(float spacing, float amplitude, float flatRadius, uint32_t seed)
+    {
+        this->spacing = spacing;
+        inverseSpacing = 1 / spacing;
+        this->amplitude = amplitude;
+        this->flatRadius = flatRadius;
+        this->seed = seed;
+        float inside = flatRadius - 2 * spacing;
+        flatInside = inside > 0 ? inside * inside : 0;
+        float total = 0;
+        float weight = 1;
+        for (float wavelength = 1024; wavelength >= 32; wavelength *= 0.5f, weight *= 0.5f)
+            total += weight;
+        scale = amplitude / total;
+        rehash(minSlots, KeepNone());
+    }
+
+    //Call once per tick while no other thread reads the field: drops the tiles nothing has asked
+    //for in keepTicks calls, and grows the table before it gets too full to take new tiles
+    void update(unsigned int keepTicks = 600)
+    {
+        clock++;
+        unsigned int count = tileCount.load(std::memory_order_relaxed);
+        unsigned int slotCount = slotMask + 1;
+        if (count * 4 > slotCount)
+            rehash(slotCount * 2, KeepAll());
+        else if (clock % 64 == 0)
+        {
+            KeepRecent keep = {clock, keepTicks};
+            while (slotCount > minSlots && count * 16 < slotCount)
+                slotCount /= 2;
+            rehash(slotCount, keep);
+        }
+    }
+
+    unsigned int residentTiles() const
+    {
+        return tileCount.load(std::memory_order_relaxed);
+    }
+
+    float getSpacing() const
+    {
+        return spacing;
+    }
+
+    //Height of sample (i, j)
+    float sample(int i, int j) const
+    {
+        int tileX = floorDiv(i);
+        int tileZ = floorDiv(j);
+        const Tile* t = tile(tileX, tileZ);
+        if (!t)
+            return sampleAt(i, j);
+        return t->heights[(j - tileZ * tileQuads) * tileSamples + (i - tileX * tileQuads)];
+    }
+
+    float height(float x, float z) const
+    {
+        if (amplitude == 0 || x * x + z * z < flatInside)
+            return 0;
+        // clamped far beyond anything, so the sample indices stay in range
+        float gx = fminf(fmaxf(x * inverseSpacing, -1e8f), 1e8f);
+        float gz = fminf(fmaxf(z * inverseSpacing, -1e8f), 1e8f);
+        float fi = floorf(gx);
+        float fj = floorf(gz);
+        int i = (int)fi;
+        int j = (int)fj;
+        float u = gx - fi;
+        float v = gz - fj;
+        int tileX = floorDiv(i);
+        int tileZ = floorDiv(j);
+        float a, b, c, d;
+        const Tile* t = tile(tileX, tileZ);
+        if (t)
+        {
+            const float* row = &t->heights[(j - tileZ * tileQuads) * tileSamples + (i - tileX * tileQuads)];
+            a = row[0];
+            b = row[1];
+            c = row[tileSamples];
+            d = row[tileSamples + 1];
+        }
+        else
+        {
+            a = sampleAt(i, j);
+            b = sampleAt(i + 1, j);
+            c = sampleAt(i, j + 1);
+            d = sampleAt(i + 1, j + 1);
+        }
+        // the cell is split along its (i, j) - (i+1, j+1) diagonal
+        if (u >= v)
+            return a + (b - a) * u + (d - b) * v;
+        return a + (c - a) * v + (d - c) * u;
+    }
+
+    //Unit surface normal at sample (i, j) from central differences
+    float3 normal(int i, int j) const
+    {
+        float dx = (sample(i + 1, j) - sample(i - 1, j)) / (2 * spacing);
+        float dz = (sample(i, j + 1) - sample(i, j - 1)) / (2 * spacing);
+        return float3(-dx, 1, -dz).normalize();
+    }
+};
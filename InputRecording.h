@@ -0,0 +1,144 @@
+#pragma once
+
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+//Input and timing of a run, tick by tick, so the run can be replayed exactly: headless to check the
+//simulation, or rendered to time two builds on the same workload. Every tick also keeps a hash of the
+//simulation state after it, which a replay compares to find the first tick where two runs part ways.
+//File layout: "RPLY", version, tick count, then for every tick t and dt exactly as Scene::step got
+//them, the input events since the previous tick and the state hash.
+class InputRecording
+{
+public:
+    enum EventType { keyDown, keyUp, mouseDown, mouseUp, mouseMotion };
+
+    struct Event
+    {
+        unsigned char type;
+        unsigned char key;      // key events
+        short x;                // mouse events, window coordinates
+        short y;
+    };
+
+    struct Tick
+    {
+        float t;
+        float dt;
+        std::vector<Event> events;
+        unsigned long long hash;
+    };
+
+    static const uint32_t version = 1;
+
+    std::vector<Tick> ticks;
+
+private:
+    std::vector<Event> pending;
+
+    template<typename T>
+    static void write(FILE* file, T value)
+    {
+        fwrite(&value, sizeof(T), 1, file);
+    }
+
+    template<typename T>
+    static bool read(FILE* file, T& value)
+    {
+        return fread(&value, sizeof(T), 1, file) == 1;
+    }
+
+public:
+    //Events are held until the tick they happened before is finished
+    void addEvent(EventType type, unsigned char key, int x = 0, int y = 0)
+    {
+        Event event;
+        event.type = type;
+        event.key = key;
+        event.x = x;
+        event.y = y;
+        pending.push_back(event);
+    }
+
+    void endTick(float t, float dt, unsigned long long hash)
+    {
+        Tick tick;
+        tick.t = t;
+        tick.dt = dt;
+        tick.events.swap(pending);
+        tick.hash = hash;
+        ticks.push_back(tick);
+    }
+
+    //Key events take 2 bytes and mouse events 5, so an idle tick is 18 bytes
+    bool save(const char* filename)
+    {
+        FILE* file = fopen(filename, "wb");
+        if (!file)
+            return false;
+        fwrite("RPLY", 4, 1, file);
+        write<uint32_t>(file, version);
+        write<uint32_t>(file, ticks.size());
+        for (unsigned int i = 0; i < ticks.size(); i++)
+        {
+            const Tick& tick = ticks[i];
+            write<float>(file, tick.t);
+            write<float>(file, tick.dt);
+            write<uint16_t>(file, tick.events.size());
+            for (unsigned int j = 0; j < tick.events.size(); j++)
+            {
+                const Event& event = tick.events[j];
+                write<uint8_t>(file, event.type);
+                if (event.type == keyDown || event.type == keyUp)
+                    write<uint8_t>(file, event.key);
+                else
+                {
+                    write<int16_t>(file, event.x);
+                    write<int16_t>(file, event.y);
+                }
+            }
+            write<uint64_t>(file, tick.hash);
+        }
+        return fclose(file) == 0;
+    }
+
+    bool load(const char* filename)
+    {
+        ticks.clear();
+        FILE* file = fopen(filename, "rb");
+        if (!file)
+            return false;
+        char magic[4];
+        uint32_t fileVersion, tickCount;
+        bool ok = fread(magic, 4, 1, file) == 1 && memcmp(magic, "RPLY", 4) == 0
+            && read(file, fileVersion) && fileVersion == version && read(file, tickCount);
+        for (uint32_t i = 0; ok && i < tickCount; i++)
+        {
+            Tick tick;
+            uint16_t eventCount;
+            ok = read(file, tick.t) && read(file, tick.dt) && read(file, eventCount);
+            for (unsigned int j = 0; ok && j < eventCount; j++)
+            {
+                Event event = Event();
+                uint8_t type;
+                ok = read(file, type);
+                event.type = type;
+                if (type == keyDown || type == keyUp)
+                    ok = ok && read(file, event.key);
+                else
+                    ok = ok && read(file, event.x) && read(file, event.y);
+                tick.events.push_back(event);
+            }
+            uint64_t hash;
+            ok = ok && read(file, hash);
+            tick.hash = hash;
+            ticks.push_back(tick);
+        }
+        fclose(file);
+        if (!ok)
+            ticks.clear();
+        return ok;
+    }
+};
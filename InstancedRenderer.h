@@ -0,0 +1,219 @@
+#pragma once
+
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <OpenGL/gl.h>
+
+#include "MeshGeometry.h"
+
+//Vertex program that reads a per-instance model matrix from four instanced attributes, so a whole
+//group of objects sharing a mesh and material can be drawn with one glDrawElementsInstancedARB.
+//Fragment side mimics the fixed-function setup the game uses: GL_REPLACE texturing, or per-vertex
+//diffuse lighting from light 0 when untextured, and flat black in the shadow pass.
+class InstanceShader
+{
+    GLuint program;
+    GLint shearLocation;
+    GLint texturedLocation;
+    GLint shadowPassLocation;
+    GLint textureLocation;
+
+    static GLuint compile(GLenum type, const char* source)
+    {
+        GLuint shader = glCreateShader(type);
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+        GLint ok = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        if (!ok)
+        {
+            char log[1024];
+            glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+            printf("InstanceShader: %s\n", log);
+        }
+        return shader;
+    }
+
+public:
+    //generic attribute slots of the instance matrix columns; 12-15 alias nothing the game uses
+    static const GLuint matrixAttribute = 12;
+
+    InstanceShader():program(0){}
+
+    ~InstanceShader()
+    {
+        if (program)
+            glDeleteProgram(program);
+    }
+
+    static bool isSupported()
+    {
+        const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+        return extensions
+            && strstr(extensions, "GL_ARB_instanced_arrays")
+            && strstr(extensions, "GL_ARB_draw_instanced")
+            && strstr(extensions, "GL_ARB_shading_language_100");
+    }
+
+    bool create()
+    {
+        const char* vertexSource =
+            "#version 120\n"
+            "#extension GL_ARB_draw_instanced : enable\n"
+            "attribute vec4 instanceColumn0;\n"
+            "attribute vec4 instanceColumn1;\n"
+            "attribute vec4 instanceColumn2;\n"
+            "attribute vec4 instanceColumn3;\n"
+            "uniform mat4 shear;\n"
+            "varying vec4 color;\n"
+            "void main()\n"
+            "{\n"
+            "    mat4 model = mat4(instanceColumn0, instanceColumn1, instanceColumn2, instanceColumn3);\n"
+            "    gl_Position = gl_ModelViewProjectionMatrix * (model * (shear * gl_Vertex));\n"
+            "    vec3 normal = normalize(gl_NormalMatrix * (mat3(model[0].xyz, model[1].xyz, model[2].xyz) * gl_Normal));\n"
+            "    vec3 lightDir = normalize(gl_LightSource[0].position.xyz);\n"
+            "    color = gl_FrontMaterial.diffuse * gl_LightSource[0].diffuse * max(dot(normal, lightDir), 0.0);\n"
+            "    color.a = gl_FrontMaterial.diffuse.a;\n"
+            "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+            "}\n";
+        const char* fragmentSource =
+            "#version 120\n"
+            "uniform bool textured;\n"
+            "uniform bool shadowPass;\n"
+            "uniform sampler2D colorTexture;\n"
+            "varying vec4 color;\n"
+            "void main()\n"
+            "{\n"
+            "    if (shadowPass)\n"
+            "        gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
+            "    else if (textured)\n"
+            "        gl_FragColor = texture2D(colorTexture, gl_TexCoord[0].st);\n"
+            "    else\n"
+            "        gl_FragColor = color;\n"
+            "}\n";
+
+        program = glCreateProgram();
+        GLuint vertexShader = compile(GL_VERTEX_SHADER, vertexSource);
+        GLuint fragmentShader = compile(GL_FRAGMENT_SHADER, fragmentSource);
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+        glBindAttribLocation(program, matrixAttribute + 0, "instanceColumn0");
+        glBindAttribLocation(program, matrixAttribute + 1, "instanceColumn1");
+        glBindAttribLocation(program, matrixAttribute + 2, "instanceColumn2");
+        glBindAttribLocation(program, matrixAttribute + 3, "instanceColumn3");
+        glLinkProgram(program);
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+
+        GLint ok = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &ok);
+        if (!ok)
+        {
+            glDeleteProgram(program);
+            program = 0;
+            return false;
+        }
+        shearLocation = glGetUniformLocation(program, "shear");
+        texturedLocation = glGetUniformLocation(program, "textured");
+        shadowPassLocation = glGetUniformLocation(program, "shadowPass");
+        textureLocation = glGetUniformLocation(program, "colorTexture");
+        return true;
+    }
+
+    //shear is the column-major matrix applied in model space before the instance transform
+    void begin(bool textured, bool shadowPass, const float* shear)
+    {
+        glUseProgram(program);
+        glUniformMatrix4fv(shearLocation, 1, GL_FALSE, shear);
+        glUniform1i(texturedLocation, textured);
+        glUniform1i(shadowPassLocation, shadowPass);
+        glUniform1i(textureLocation, 0);
+    }
+
+    void end()
+    {
+        glUseProgram(0);
+    }
+};
+
+//All instances of one mesh level of detail drawn with one material, with their model matrices
+//(column-major, 16 floats each) streamed into a per-instance vertex buffer
+class InstanceBatch
+{
+    GLuint instanceBuffer;
+    std::vector<float> uploadedMatrices;
+
+    //Only re-uploads when some instance actually moved since the last frame
+    void uploadMatrices()
+    {
+        if (!instanceBuffer)
+            glGenBuffers(1, &instanceBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+        if (matrices.size() != uploadedMatrices.size()
+            || memcmp(matrices.data(), uploadedMatrices.data(), matrices.size() * sizeof(float)) != 0)
+        {
+            glBufferData(GL_ARRAY_BUFFER, matrices.size() * sizeof(float), matrices.data(), GL_DYNAMIC_DRAW);
+            uploadedMatrices = matrices;
+        }
+    }
+
+public:
+    MeshGeometry* geometry;
+    int lod;
+    std::vector<float> matrices;
+
+    InstanceBatch(MeshGeometry* geometry, int lod = 0):instanceBuffer(0),geometry(geometry),lod(lod){}
+
+    ~InstanceBatch()
+    {
+        if (instanceBuffer)
+            glDeleteBuffers(1, &instanceBuffer);
+    }
+
+    int count()
+    {
+        return matrices.size() / 16;
+    }
+
+    //One instanced draw call for the whole batch; the shader must already be bound
+    void drawInstanced()
+    {
+        if (count() == 0)
+            return;
+        geometry->bind();
+        uploadMatrices();
+        for (GLuint column = 0; column < 4; column++)
+        {
+            GLuint attribute = InstanceShader::matrixAttribute + column;
+            glEnableVertexAttribArray(attribute);
+            glVertexAttribPointer(attribute, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (void*)(column * 4 * sizeof(float)));
+            glVertexAttribDivisorARB(attribute, 1);
+        }
+        const MeshGeometry::Lod& range = geometry->lods[lod];
+        glDrawElementsInstancedARB(GL_TRIANGLES, range.count, GL_UNSIGNED_INT, (void*)(range.first * sizeof(unsigned int)), count());
+        for (GLuint column = 0; column < 4; column++)
+        {
+            GLuint attribute = InstanceShader::matrixAttribute + column;
+            glVertexAttribDivisorARB(attribute, 0);
+            glDisableVertexAttribArray(attribute);
+        }
+        geometry->unbind();
+    }
+
+    //Fallback without instancing support: mesh buffers bound once, one draw per instance
+    void drawEach(const float* shear)
+    {
+        geometry->bind();
+        glMatrixMode(GL_MODELVIEW);
+        for (int i = 0; i < count(); i++)
+        {
+            glPushMatrix();
+            glMultMatrixf(&matrices[16 * i]);
+            glMultMatrixf(shear);
+            geometry->drawElements(lod);
+            glPopMatrix();
+        }
+        geometry->unbind();
+    }
+};
@@ -0,0 +1,74 @@
+//Converts OBJ meshes into the binary .mbin format the game maps at startup.
+//  MeshConvert model.obj [model.mbin]
+//Without an output name the .mbin is written next to the OBJ, where AssetLoader looks for it.
+
+#include <stdio.h>
+#include <chrono>
+#include <string>
+
+#include "MeshGeometry.h"
+
+static double since(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s model.obj [model.mbin]\n", argv[0]);
+        return 1;
+    }
+    std::string output = argc > 2 ? argv[2] : MeshGeometry::binaryName(argv[1]);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    MeshGeometry geometry(argv[1], false);
+    double parseSeconds = since(start);
+    if (geometry.isEmpty())
+    {
+        printf("%s has no triangles\n", argv[1]);
+        return 1;
+    }
+
+    //optimize step by step, to show what each pass does to the post-transform cache
+    unsigned int objVertices = geometry.vertexCount;
+    float objAcmr = geometry.acmr();
+    geometry.deduplicate();
+    geometry.useArrays();
+    unsigned int uniqueVertices = geometry.vertexCount;
+    float dedupAcmr = geometry.acmr();
+    start = std::chrono::steady_clock::now();
+    geometry.reorderTriangles();
+    geometry.reorderVertices();
+    geometry.useArrays();
+    double optimizeSeconds = since(start);
+    printf("vertices %u -> %u after deduplication\n", objVertices, uniqueVertices);
+    printf("ACMR (16 entry FIFO): %.3f as parsed, %.3f deduplicated, %.3f reordered (%.3f ms)\n",
+           objAcmr, dedupAcmr, geometry.acmr(), optimizeSeconds * 1000);
+
+    start = std::chrono::steady_clock::now();
+    geometry.buildLods();
+    geometry.useArrays();
+    double lodSeconds = since(start);
+    for (unsigned int i = 0; i < geometry.lods.size(); i++)
+        printf("LOD %u: %6d triangles, error %.4f\n", i, geometry.triangleCount(i), geometry.lods[i].error);
+    printf("LODs built in %.3f ms\n", lodSeconds * 1000);
+    if (!geometry.save(output.c_str()))
+        return 1;
+
+    //map it back to check the file and to compare load times
+    start = std::chrono::steady_clock::now();
+    MeshGeometry mapped(output.c_str());
+    double mapSeconds = since(start);
+    if (mapped.vertexCount != geometry.vertexCount || mapped.indexCount != geometry.indexCount || mapped.lods.size() != geometry.lods.size())
+    {
+        printf("%s did not read back correctly\n", output.c_str());
+        return 1;
+    }
+
+    size_t bytes = sizeof(MeshGeometry::BinaryHeader) + geometry.lods.size() * sizeof(MeshGeometry::Lod) + geometry.vertexCount * sizeof(MeshGeometry::Vertex) + geometry.indexCount * sizeof(unsigned int);
+    printf("%s: %u vertices, %d triangles, %zu bytes\n", output.c_str(), geometry.vertexCount, geometry.triangleCount(), bytes);
+    printf("parse %.3f ms, map %.3f ms\n", parseSeconds * 1000, mapSeconds * 1000);
+    return 0;
+}
@@ -0,0 +1,686 @@
+#pragma once
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <OpenGL/gl.h>
+
+#include "float2.h"
+#include "float3.h"
+#include "MeshSimplifier.h"
+#include "TriangleBVH.h"
+
+//Triangle geometry of an OBJ file in contiguous, interleaved arrays.
+//Uploaded once into GL buffer objects on first draw, then drawn from GPU memory every frame.
+//Also reads and writes a binary .mbin version of the same arrays (see MeshConvert.cpp), which is
+//memory-mapped as is: no parsing and no per-vertex allocation. Loading still reads the whole file
+//once, to validate the indices and build the BVH, so all of it is resident after load; the pages
+//are clean file pages, though, which the system can drop again without writing them anywhere.
+class MeshGeometry
+{
+public:
+    struct Vertex
+    {
+        float position[3];
+        float normal[3];
+        float texcoord[2];
+    };
+
+    //Level of detail: a range of the index array, all levels sharing the vertex array.
+    //Level 0 is the full mesh; error is the largest surface deviation of the level in model units.
+    struct Lod
+    {
+        uint32_t first;
+        uint32_t count;
+        float error;
+    };
+
+    //.mbin layout: this header, lodCount Lod records, vertexCount Vertex records, then indexCount
+    //32-bit indices, all in the byte order of the machine that wrote it
+    struct BinaryHeader
+    {
+        char magic[4];          // "MBIN"
+        uint32_t version;
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        float min[3];           // bounding box
+        float max[3];
+        float radius;           // bounding sphere around the box center
+        uint32_t lodCount;
+    };
+
+    static const uint32_t binaryVersion = 2;
+
+    //arrays parsed from an OBJ; empty when the geometry is mapped from a .mbin
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+
+    //what is drawn: points into the vectors above or into the mapping
+    const Vertex* vertexData;
+    const unsigned int* indexData;
+    unsigned int vertexCount;
+    unsigned int indexCount;
+
+    float3 boundsMin;
+    float3 boundsMax;
+    float boundsRadius;
+
+    std::vector<Lod> lods;
+
+    //the full detail triangles, for exact collision and picking queries; empty until buildBVH()
+    TriangleBVH bvh;
+
+private:
+    GLuint vertexBuffer;
+    GLuint indexBuffer;
+    bool uploaded;
+    void* mapping;
+    size_t mappingSize;
+
+    //Resolves a 1-based (or negative, relative) OBJ index
+    static int objIndex(int i, int count)
+    {
+        return i > 0 ? i - 1 : count + i;
+    }
+
+    void load(const char* filename)
+    {
+        FILE* file = fopen(filename, "r");
+        if (file == NULL)
+        {
+            printf("MeshGeometry: cannot open %s\n", filename);
+            return;
+        }
+
+        std::vector<float3> positions;
+        std::vector<float3> normals;
+        std::vector<float2> texcoords;
+        //getline grows the buffer, so long face lines are not split into bogus records
+        char* line = 0;
+        size_t capacity = 0;
+        unsigned int badFaces = 0;
+        while (getline(&line, &capacity, file) >= 0)
+        {
+            float x, y, z;
+            if (line[0] == 'v' && line[1] == ' ' && sscanf(line + 2, "%f %f %f", &x, &y, &z) == 3)
+                positions.push_back(float3(x, y, z));
+            else if (line[0] == 'v' && line[1] == 'n' && sscanf(line + 3, "%f %f %f", &x, &y, &z) == 3)
+                normals.push_back(float3(x, y, z));
+            else if (line[0] == 'v' && line[1] == 't' && sscanf(line + 3, "%f %f", &x, &y) == 2)
+                texcoords.push_back(float2(x, y));
+            else if (line[0] == 'f' && line[1] == ' ')
+            {
+                //polygon corners as p, p/t, p//n or p/t/n; triangulated as a fan. A face with a
+                //missing or out of range index is skipped, not loaded half right
+                std::vector<Vertex> corners;
+                bool missingNormal = false;
+                bool bad = false;
+                //strtok_r keeps its cursor here, meshes are parsed on several threads at once
+                char* cursor = 0;
+                char* token = strtok_r(line + 2, " \t\r\n", &cursor);
+                while (token)
+                {
+                    int p = 0, t = 0, n = 0;
+                    if (sscanf(token, "%d/%d/%d", &p, &t, &n) != 3 && sscanf(token, "%d//%d", &p, &n) != 2)
+                        if (sscanf(token, "%d/%d", &p, &t) != 2)
+                            sscanf(token, "%d", &p);
+                    int position = objIndex(p, positions.size());
+                    int normal = objIndex(n, normals.size());
+                    int texcoord = objIndex(t, texcoords.size());
+                    if (p == 0 || position < 0 || position >= (int)positions.size()
+                        || (n != 0 && (normal < 0 || normal >= (int)normals.size()))
+                        || (t != 0 && (texcoord < 0 || texcoord >= (int)texcoords.size())))
+                    {
+                        bad = true;
+                        break;
+                    }
+
+                    Vertex v;
+                    memset(&v, 0, sizeof(v));
+                    v.position[0] = positions[position].x; v.position[1] = positions[position].y; v.position[2] = positions[position].z;
+                    if (n != 0)
+                    {
+                        v.normal[0] = normals[normal].x; v.normal[1] = normals[normal].y; v.normal[2] = normals[normal].z;
+                    }
+                    else
+                        missingNormal = true;
+                    if (t != 0)
+                    {
+                        //stb_image hands rows over top first, so v is flipped
+                        v.texcoord[0] = texcoords[texcoord].x; v.texcoord[1] = 1 - texcoords[texcoord].y;
+                    }
+                    corners.push_back(v);
+                    token = strtok_r(NULL, " \t\r\n", &cursor);
+                }
+                if (bad)
+                {
+                    badFaces++;
+                    continue;
+                }
+                for (unsigned int i = 2; i < corners.size(); i++)
+                {
+                    addTriangle(corners[0], corners[i-1], corners[i], missingNormal);
+                }
+            }
+        }
+        free(line);
+        if (badFaces)
+            printf("MeshGeometry: skipped %u faces with bad indices in %s\n", badFaces, filename);
+        fclose(file);
+    }
+
+    //Hashes and compares whole vertices bytewise, for deduplication
+    struct VertexKey
+    {
+        size_t operator()(const Vertex& v) const
+        {
+            const unsigned char* bytes = (const unsigned char*)&v;
+            size_t hash = 2166136261u;
+            for (unsigned int i = 0; i < sizeof(Vertex); i++)
+                hash = (hash ^ bytes[i]) * 16777619u;
+            return hash;
+        }
+
+        bool operator()(const Vertex& a, const Vertex& b) const
+        {
+            return memcmp(&a, &b, sizeof(Vertex)) == 0;
+        }
+    };
+
+    static float forsythScore(int cachePosition, unsigned int remaining, int cacheSize)
+    {
+        if (remaining == 0)
+            return -1;
+        float score = 0;
+        if (cachePosition >= 0)
+        {
+            //the three vertices of the last triangle get a fixed score so it is not simply repeated
+            if (cachePosition < 3)
+                score = 0.75f;
+            else
+                score = powf(1.0f - (cachePosition - 3) / (float)(cacheSize - 3), 1.5f);
+        }
+        return score + 2.0f / sqrtf((float)remaining);
+    }
+
+    //Maps a .mbin file; leaves the geometry empty if the file is missing or malformed
+    void map(const char* filename)
+    {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+        {
+            printf("MeshGeometry: cannot open %s\n", filename);
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(BinaryHeader))
+        {
+            mapping = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+                mapping = 0;
+            else
+                mappingSize = info.st_size;
+        }
+        close(fd);
+        if (!mapping)
+        {
+            printf("MeshGeometry: cannot map %s\n", filename);
+            return;
+        }
+
+        //nothing in the file is trusted: the sizes must add up to the file, every LOD must lie inside
+        //the index array and every index inside the vertex array. Checking the indices reads them
+        //all, but buildBVH reads them right after anyway.
+        const BinaryHeader* header = (const BinaryHeader*)mapping;
+        size_t expected = sizeof(BinaryHeader) + (size_t)header->lodCount * sizeof(Lod)
+            + (size_t)header->vertexCount * sizeof(Vertex) + (size_t)header->indexCount * sizeof(unsigned int);
+        bool valid = memcmp(header->magic, "MBIN", 4) == 0 && header->version == binaryVersion
+            && mappingSize == expected && header->lodCount > 0 && header->indexCount % 3 == 0;
+        const Lod* lodTable = (const Lod*)(header + 1);
+        const Vertex* vertexArray = (const Vertex*)(lodTable + (valid ? header->lodCount : 0));
+        const unsigned int* indexArray = (const unsigned int*)(vertexArray + (valid ? header->vertexCount : 0));
+        for (uint32_t i = 0; valid && i < header->lodCount; i++)
+            valid = lodTable[i].first % 3 == 0 && lodTable[i].count % 3 == 0
+                && (uint64_t)lodTable[i].first + lodTable[i].count <= header->indexCount;
+        for (uint32_t i = 0; valid && i < header->indexCount; i++)
+            valid = indexArray[i] < header->vertexCount;
+        if (!valid)
+        {
+            printf("MeshGeometry: %s is not a valid version %u mesh file\n", filename, binaryVersion);
+            munmap(mapping, mappingSize);
+            mapping = 0;
+            mappingSize = 0;
+            return;
+        }
+        lods.assign(lodTable, lodTable + header->lodCount);
+        vertexData = vertexArray;
+        indexData = indexArray;
+        vertexCount = header->vertexCount;
+        indexCount = header->indexCount;
+        boundsMin = float3(header->min[0], header->min[1], header->min[2]);
+        boundsMax = float3(header->max[0], header->max[1], header->max[2]);
+        boundsRadius = header->radius;
+    }
+
+    static bool endsWith(const std::string& s, const char* suffix)
+    {
+        size_t n = strlen(suffix);
+        return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+    }
+
+    void addTriangle(Vertex a, Vertex b, Vertex c, bool computeNormal)
+    {
+        if (computeNormal)
+        {
+            float3 pa(a.position[0], a.position[1], a.position[2]);
+            float3 pb(b.position[0], b.position[1], b.position[2]);
+            float3 pc(c.position[0], c.position[1], c.position[2]);
+            float3 normal = (pb - pa).cross(pc - pa);
+            if (normal.norm2() > 0)
+                normal = normal.normalize();
+            Vertex* corners[3] = {&a, &b, &c};
+            for (int i = 0; i < 3; i++)
+            {
+                corners[i]->normal[0] = normal.x; corners[i]->normal[1] = normal.y; corners[i]->normal[2] = normal.z;
+            }
+        }
+        indices.push_back(vertices.size()); vertices.push_back(a);
+        indices.push_back(vertices.size()); vertices.push_back(b);
+        indices.push_back(vertices.size()); vertices.push_back(c);
+    }
+
+public:
+    //Parses and optimizes an OBJ, or maps the file if its name ends in .mbin (already optimized by MeshConvert)
+    MeshGeometry(const char* filename, bool optimized = true):vertexData(0),indexData(0),vertexCount(0),indexCount(0),boundsRadius(0),
+                                       vertexBuffer(0),indexBuffer(0),uploaded(false),mapping(0),mappingSize(0)
+    {
+        if (endsWith(filename, ".mbin"))
+            map(filename);
+        else
+        {
+            load(filename);
+            if (optimized)
+            {
+                optimize();
+                buildLods();
+            }
+            useArrays();
+        }
+    }
+
+    ~MeshGeometry()
+    {
+        if (uploaded)
+        {
+            glDeleteBuffers(1, &vertexBuffer);
+            glDeleteBuffers(1, &indexBuffer);
+        }
+        if (mapping)
+            munmap(mapping, mappingSize);
+    }
+
+    //Name of the binary version of an OBJ: same path with the extension replaced by .mbin
+    static std::string binaryName(const char* filename)
+    {
+        std::string name(filename);
+        size_t dot = name.find_last_of('.');
+        size_t slash = name.find_last_of('/');
+        if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+            name.erase(dot);
+        return name + ".mbin";
+    }
+
+    //Merges identical vertices so every corner shared by several triangles is stored once
+    void deduplicate()
+    {
+        std::unordered_map<Vertex, unsigned int, VertexKey, VertexKey> unique;
+        std::vector<Vertex> merged;
+        for (unsigned int i = 0; i < indices.size(); i++)
+        {
+            const Vertex& v = vertices[indices[i]];
+            std::unordered_map<Vertex, unsigned int, VertexKey, VertexKey>::iterator found = unique.find(v);
+            if (found == unique.end())
+            {
+                found = unique.insert(std::make_pair(v, (unsigned int)merged.size())).first;
+                merged.push_back(v);
+            }
+            indices[i] = found->second;
+        }
+        vertices.swap(merged);
+    }
+
+    //Forsyth's linear-speed vertex cache optimisation: greedily emits the triangle whose vertices
+    //score highest, favouring vertices still in a simulated LRU cache and vertices with few
+    //triangles left, so neighbouring triangles reuse the post-transform cache
+    static void reorderTriangles(std::vector<unsigned int>& indices, unsigned int vertexCount)
+    {
+        const int cacheSize = 32;
+        unsigned int triangleCount = indices.size() / 3;
+        if (triangleCount == 0)
+            return;
+
+        //triangles using each vertex, as ranges of one flat array
+        std::vector<unsigned int> remaining(vertexCount, 0);
+        for (unsigned int i = 0; i < indices.size(); i++)
+            remaining[indices[i]]++;
+        std::vector<unsigned int> firstTriangle(vertexCount + 1, 0);
+        for (unsigned int v = 0; v < vertexCount; v++)
+            firstTriangle[v+1] = firstTriangle[v] + remaining[v];
+        std::vector<unsigned int> vertexTriangles(indices.size());
+        std::vector<unsigned int> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+        for (unsigned int i = 0; i < indices.size(); i++)
+            vertexTriangles[filled[indices[i]]++] = i / 3;
+
+        std::vector<int> cachePosition(vertexCount, -1);
+        std::vector<float> vertexScore(vertexCount);
+        for (unsigned int v = 0; v < vertexCount; v++)
+            vertexScore[v] = forsythScore(-1, remaining[v], cacheSize);
+        std::vector<float> triangleScore(triangleCount);
+        for (unsigned int t = 0; t < triangleCount; t++)
+            triangleScore[t] = vertexScore[indices[3*t]] + vertexScore[indices[3*t+1]] + vertexScore[indices[3*t+2]];
+        std::vector<unsigned char> emitted(triangleCount, 0);
+
+        std::vector<unsigned int> reordered;
+        reordered.reserve(indices.size());
+        std::vector<unsigned int> cache;
+        unsigned int scan = 0;
+        while (reordered.size() < indices.size())
+        {
+            //best triangle around the cached vertices; a linear scan only when the cache runs dry
+            int best = -1;
+            float bestScore = -1;
+            for (unsigned int c = 0; c < cache.size(); c++)
+            {
+                unsigned int v = cache[c];
+                for (unsigned int i = firstTriangle[v]; i < firstTriangle[v+1]; i++)
+                {
+                    unsigned int t = vertexTriangles[i];
+                    if (!emitted[t] && triangleScore[t] > bestScore)
+                    {
+                        best = t;
+                        bestScore = triangleScore[t];
+                    }
+                }
+            }
+            if (best < 0)
+            {
+                while (emitted[scan])
+                    scan++;
+                best = scan;
+            }
+
+            emitted[best] = 1;
+            std::vector<unsigned int> touched(cache);
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int v = indices[3*best+k];
+                reordered.push_back(v);
+                remaining[v]--;
+                //move v to the front of the cache
+                std::vector<unsigned int>::iterator inCache = std::find(cache.begin(), cache.end(), v);
+                if (inCache != cache.end())
+                    cache.erase(inCache);
+                cache.insert(cache.begin(), v);
+                touched.push_back(v);
+            }
+            //vertices pushed out of the cache lose their cache bonus
+            while (cache.size() > (unsigned int)cacheSize)
+                cache.pop_back();
+            for (unsigned int i = 0; i < touched.size(); i++)
+                cachePosition[touched[i]] = -1;
+            for (unsigned int c = 0; c < cache.size(); c++)
+                cachePosition[cache[c]] = c;
+
+            for (unsigned int i = 0; i < touched.size(); i++)
+            {
+                unsigned int v = touched[i];
+                float score = forsythScore(cachePosition[v], remaining[v], cacheSize);
+                float delta = score - vertexScore[v];
+                if (delta == 0)
+                    continue;
+                vertexScore[v] = score;
+                for (unsigned int j = firstTriangle[v]; j < firstTriangle[v+1]; j++)
+                    triangleScore[vertexTriangles[j]] += delta;
+            }
+        }
+        indices.swap(reordered);
+    }
+
+    void reorderTriangles()
+    {
+        reorderTriangles(indices, vertices.size());
+    }
+
+    //Renumbers vertices in the order the triangles first use them, so vertex fetches walk memory forwards
+    void reorderVertices()
+    {
+        std::vector<int> remap(vertices.size(), -1);
+        std::vector<Vertex> ordered;
+        ordered.reserve(vertices.size());
+        for (unsigned int i = 0; i < indices.size(); i++)
+        {
+            if (remap[indices[i]] < 0)
+            {
+                remap[indices[i]] = ordered.size();
+                ordered.push_back(vertices[indices[i]]);
+            }
+            indices[i] = remap[indices[i]];
+        }
+        vertices.swap(ordered);
+    }
+
+    //Points the draw arrays at the vectors and recomputes the bounds; call after changing them
+    void useArrays()
+    {
+        vertexData = vertices.data();
+        indexData = indices.data();
+        vertexCount = vertices.size();
+        indexCount = indices.size();
+        if (lods.empty())
+        {
+            Lod base = {0, indexCount, 0};
+            lods.push_back(base);
+        }
+        boundsMin = boundsMax = float3(0,0,0);
+        boundsRadius = 0;
+        if (vertices.empty())
+            return;
+        boundsMin = boundsMax = float3(vertices[0].position[0], vertices[0].position[1], vertices[0].position[2]);
+        for (unsigned int i = 1; i < vertices.size(); i++)
+        {
+            const float* p = vertices[i].position;
+            boundsMin = float3(fminf(boundsMin.x, p[0]), fminf(boundsMin.y, p[1]), fminf(boundsMin.z, p[2]));
+            boundsMax = float3(fmaxf(boundsMax.x, p[0]), fmaxf(boundsMax.y, p[1]), fmaxf(boundsMax.z, p[2]));
+        }
+        float3 center = (boundsMin + boundsMax) * 0.5;
+        float radius2 = 0;
+        for (unsigned int i = 0; i < vertices.size(); i++)
+        {
+            const float* p = vertices[i].position;
+            float d2 = (float3(p[0], p[1], p[2]) - center).norm2();
+            if (d2 > radius2)
+                radius2 = d2;
+        }
+        boundsRadius = sqrtf(radius2);
+    }
+
+    //Appends ever coarser levels to the index array, each with about half the triangles of the one
+    //before, until simplification stalls or a level gets down to minTriangles. Run after optimize().
+    void buildLods(unsigned int maxLevels = 6, unsigned int minTriangles = 32)
+    {
+        unsigned int baseCount = lods.empty() ? indices.size() : lods[0].count;
+        indices.resize(baseCount);
+        lods.clear();
+        Lod base = {0, baseCount, 0};
+        lods.push_back(base);
+        if (vertices.empty())
+            return;
+
+        MeshSimplifier simplifier(vertices[0].position, vertices[0].normal, sizeof(Vertex) / sizeof(float),
+                                  vertices.size(), indices.data(), baseCount);
+        while (lods.size() < maxLevels)
+        {
+            unsigned int triangles = lods.back().count / 3;
+            if (triangles / 2 < minTriangles)
+                break;
+            std::vector<unsigned int> level;
+            float error = simplifier.simplify(triangles / 2, level);
+            if (level.empty() || level.size() / 3 > triangles * 9 / 10)
+                break;
+            reorderTriangles(level, vertices.size());
+            Lod lod = {(uint32_t)indices.size(), (uint32_t)level.size(), error};
+            indices.insert(indices.end(), level.begin(), level.end());
+            lods.push_back(lod);
+        }
+    }
+
+    //Builds the triangle BVH over level 0; needs no GL context, so it can run on a loader thread
+    void buildBVH()
+    {
+        if (lods.empty() || vertexCount == 0)
+            return;
+        bvh.build(vertexData[0].position, sizeof(Vertex) / sizeof(float), indexData + lods[0].first, lods[0].count);
+    }
+
+    //Deduplicates, then orders triangles for the post-transform cache and vertices for fetch locality
+    void optimize()
+    {
+        deduplicate();
+        reorderTriangles();
+        reorderVertices();
+    }
+
+    //Average cache miss ratio: vertices transformed per triangle with a FIFO post-transform cache
+    //of the given size; 3 means no reuse at all, around 0.6-0.7 is typical of a well ordered mesh
+    static float acmr(const unsigned int* indices, unsigned int count, int cacheSize = 16)
+    {
+        if (count < 3)
+            return 0;
+        std::vector<unsigned int> fifo;
+        unsigned int misses = 0;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (std::find(fifo.begin(), fifo.end(), indices[i]) != fifo.end())
+                continue;
+            misses++;
+            fifo.push_back(indices[i]);
+            if (fifo.size() > (unsigned int)cacheSize)
+                fifo.erase(fifo.begin());
+        }
+        return misses / (float)(count / 3);
+    }
+
+    float acmr(int cacheSize = 16)
+    {
+        return lods.empty() ? 0 : acmr(indexData + lods[0].first, lods[0].count, cacheSize);
+    }
+
+    bool isEmpty()
+    {
+        return indexCount == 0;
+    }
+
+    //Writes the draw arrays as a .mbin file
+    bool save(const char* filename)
+    {
+        FILE* file = fopen(filename, "wb");
+        if (file == NULL)
+        {
+            printf("MeshGeometry: cannot write %s\n", filename);
+            return false;
+        }
+        BinaryHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "MBIN", 4);
+        header.version = binaryVersion;
+        header.vertexCount = vertexCount;
+        header.indexCount = indexCount;
+        header.min[0] = boundsMin.x; header.min[1] = boundsMin.y; header.min[2] = boundsMin.z;
+        header.max[0] = boundsMax.x; header.max[1] = boundsMax.y; header.max[2] = boundsMax.z;
+        header.radius = boundsRadius;
+        header.lodCount = lods.size();
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+            && fwrite(lods.data(), sizeof(Lod), lods.size(), file) == lods.size()
+            && fwrite(vertexData, sizeof(Vertex), vertexCount, file) == vertexCount
+            && fwrite(indexData, sizeof(unsigned int), indexCount, file) == indexCount;
+        fclose(file);
+        return ok;
+    }
+
+    //Copies the arrays into buffer objects; needs a current GL context
+    void upload()
+    {
+        if (uploaded)
+            return;
+        glGenBuffers(1, &vertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(Vertex), vertexData, GL_STATIC_DRAW);
+        glGenBuffers(1, &indexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(unsigned int), indexData, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        uploaded = true;
+    }
+
+    //Binds the buffers and vertex arrays; draw calls can then be issued until unbind()
+    void bind()
+    {
+        upload();
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(Vertex), (void*)offsetof(Vertex, position));
+        glNormalPointer(GL_FLOAT, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+        glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), (void*)offsetof(Vertex, texcoord));
+    }
+
+    void unbind()
+    {
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+
+    void drawElements(int lod = 0)
+    {
+        glDrawElements(GL_TRIANGLES, lods[lod].count, GL_UNSIGNED_INT, (void*)(lods[lod].first * sizeof(unsigned int)));
+    }
+
+    void draw(int lod = 0)
+    {
+        bind();
+        drawElements(lod);
+        unbind();
+    }
+
+    int triangleCount(int lod = 0)
+    {
+        return lods[lod].count / 3;
+    }
+
+    //Coarsest level whose error, seen from distance with the given pixels per model unit at
+    //distance 1, stays within maxPixels
+    int selectLod(float distance, float pixelsPerUnit, float maxPixels)
+    {
+        int lod = 0;
+        while (lod + 1 < (int)lods.size() && lods[lod+1].error * pixelsPerUnit <= maxPixels * distance)
+            lod++;
+        return lod;
+    }
+};
@@ -0,0 +1,384 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <string.h>
+#include <math.h>
+
+//Quadric error edge collapse simplification (Garland & Heckbert) of an indexed triangle mesh.
+//Vertices only ever collapse onto other existing vertices, so every level indexes the original
+//vertex array and all levels of a mesh can share one vertex buffer. Successive simplify() calls
+//continue from the previous result, producing a nested chain of ever coarser index lists.
+class MeshSimplifier
+{
+    //symmetric 4x4 matrix of the summed squared plane distances, plus the summed weight
+    struct Quadric
+    {
+        double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+        double weight;
+
+        void clear()
+        {
+            memset(this, 0, sizeof(Quadric));
+        }
+
+        void addPlane(double a, double b, double c, double d, double w)
+        {
+            a2 += w*a*a; ab += w*a*b; ac += w*a*c; ad += w*a*d;
+            b2 += w*b*b; bc += w*b*c; bd += w*b*d;
+            c2 += w*c*c; cd += w*c*d;
+            d2 += w*d*d;
+            weight += w;
+        }
+
+        void add(const Quadric& q)
+        {
+            a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+            b2 += q.b2; bc += q.bc; bd += q.bd;
+            c2 += q.c2; cd += q.cd;
+            d2 += q.d2;
+            weight += q.weight;
+        }
+
+        double evaluate(const float* p) const
+        {
+            double x = p[0], y = p[1], z = p[2];
+            return a2*x*x + 2*ab*x*y + 2*ac*x*z + 2*ad*x
+                 + b2*y*y + 2*bc*y*z + 2*bd*y
+                 + c2*z*z + 2*cd*z
+                 + d2;
+        }
+    };
+
+    struct Collapse
+    {
+        unsigned int from;
+        unsigned int to;
+        double cost;
+
+        bool operator<(const Collapse& other) const
+        {
+            return cost < other.cost;
+        }
+    };
+
+    const float* positions;
+    const float* normals;
+    unsigned int stride;                // in floats
+
+    //vertices sharing a position are welded into one group, so seams do not stop collapses
+    std::vector<unsigned int> group;            // vertex -> group
+    std::vector<unsigned int> groupVertex;      // group -> first vertex, whose position is used
+    std::vector<unsigned int> groupMembers;     // vertices of each group, as ranges
+    std::vector<unsigned int> groupFirst;
+    std::vector<unsigned int> collapsedTo;      // group -> group it was merged into, or itself
+    std::vector<Quadric> quadrics;
+
+    std::vector<unsigned int> corners;          // original vertex of each triangle corner
+    std::vector<unsigned int> triangleGroups;   // current group of each triangle corner
+    std::vector<unsigned char> live;
+    unsigned int liveCount;
+    double maxError;
+
+    const float* position(unsigned int g) const
+    {
+        return positions + groupVertex[g] * stride;
+    }
+
+    unsigned int find(unsigned int g)
+    {
+        while (collapsedTo[g] != g)
+        {
+            collapsedTo[g] = collapsedTo[collapsedTo[g]];
+            g = collapsedTo[g];
+        }
+        return g;
+    }
+
+    static void triangleNormal(const float* a, const float* b, const float* c, double* n)
+    {
+        double u[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+        double v[3] = {c[0]-a[0], c[1]-a[1], c[2]-a[2]};
+        n[0] = u[1]*v[2] - u[2]*v[1];
+        n[1] = u[2]*v[0] - u[0]*v[2];
+        n[2] = u[0]*v[1] - u[1]*v[0];
+    }
+
+    void weld(unsigned int vertexCount)
+    {
+        struct PositionKey
+        {
+            const float* positions;
+            unsigned int stride;
+            size_t operator()(unsigned int v) const
+            {
+                const unsigned char* bytes = (const unsigned char*)(positions + v * stride);
+                size_t hash = 2166136261u;
+                for (int i = 0; i < 12; i++)
+                    hash = (hash ^ bytes[i]) * 16777619u;
+                return hash;
+            }
+            bool operator()(unsigned int a, unsigned int b) const
+            {
+                return memcmp(positions + a * stride, positions + b * stride, 12) == 0;
+            }
+        };
+        PositionKey key = {positions, stride};
+        std::unordered_map<unsigned int, unsigned int, PositionKey, PositionKey> groups(vertexCount, key, key);
+        group.resize(vertexCount);
+        std::vector<unsigned int> memberCount;
+        for (unsigned int v = 0; v < vertexCount; v++)
+        {
+            std::unordered_map<unsigned int, unsigned int, PositionKey, PositionKey>::iterator found = groups.find(v);
+            if (found == groups.end())
+            {
+                found = groups.insert(std::make_pair(v, (unsigned int)groupVertex.size())).first;
+                groupVertex.push_back(v);
+                memberCount.push_back(0);
+            }
+            group[v] = found->second;
+            memberCount[found->second]++;
+        }
+        groupFirst.assign(groupVertex.size() + 1, 0);
+        for (unsigned int g = 0; g < groupVertex.size(); g++)
+            groupFirst[g+1] = groupFirst[g] + memberCount[g];
+        groupMembers.resize(vertexCount);
+        std::vector<unsigned int> filled(groupFirst.begin(), groupFirst.end() - 1);
+        for (unsigned int v = 0; v < vertexCount; v++)
+            groupMembers[filled[group[v]]++] = v;
+        collapsedTo.resize(groupVertex.size());
+        for (unsigned int g = 0; g < groupVertex.size(); g++)
+            collapsedTo[g] = g;
+    }
+
+    //Triangle planes weighted by area, plus planes through boundary edges so borders stay put
+    void computeQuadrics()
+    {
+        quadrics.resize(groupVertex.size());
+        for (unsigned int g = 0; g < quadrics.size(); g++)
+            quadrics[g].clear();
+
+        std::unordered_map<unsigned long long, int> edgeUse;
+        for (unsigned int t = 0; t < live.size(); t++)
+        {
+            if (!live[t])
+                continue;
+            const unsigned int* g = &triangleGroups[3*t];
+            double n[3];
+            triangleNormal(position(g[0]), position(g[1]), position(g[2]), n);
+            double length = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            if (length == 0)
+                continue;
+            double area = length * 0.5;
+            n[0] /= length; n[1] /= length; n[2] /= length;
+            const float* p = position(g[0]);
+            double d = -(n[0]*p[0] + n[1]*p[1] + n[2]*p[2]);
+            for (int k = 0; k < 3; k++)
+            {
+                quadrics[g[k]].addPlane(n[0], n[1], n[2], d, area);
+                unsigned int a = g[k], b = g[(k+1)%3];
+                edgeUse[a < b ? ((unsigned long long)a << 32) | b : ((unsigned long long)b << 32) | a]++;
+            }
+        }
+
+        for (unsigned int t = 0; t < live.size(); t++)
+        {
+            if (!live[t])
+                continue;
+            const unsigned int* g = &triangleGroups[3*t];
+            double n[3];
+            triangleNormal(position(g[0]), position(g[1]), position(g[2]), n);
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int a = g[k], b = g[(k+1)%3];
+                if (edgeUse[a < b ? ((unsigned long long)a << 32) | b : ((unsigned long long)b << 32) | a] != 1)
+                    continue;
+                //plane containing the edge and perpendicular to the triangle
+                const float* pa = position(a);
+                const float* pb = position(b);
+                double e[3] = {pb[0]-pa[0], pb[1]-pa[1], pb[2]-pa[2]};
+                double m[3] = {e[1]*n[2] - e[2]*n[1], e[2]*n[0] - e[0]*n[2], e[0]*n[1] - e[1]*n[0]};
+                double length = sqrt(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
+                if (length == 0)
+                    continue;
+                m[0] /= length; m[1] /= length; m[2] /= length;
+                double d = -(m[0]*pa[0] + m[1]*pa[1] + m[2]*pa[2]);
+                double weight = 10 * (e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
+                quadrics[a].addPlane(m[0], m[1], m[2], d, weight);
+                quadrics[b].addPlane(m[0], m[1], m[2], d, weight);
+            }
+        }
+    }
+
+    //Moving from onto to must not turn any remaining triangle around from over
+    bool flips(unsigned int from, unsigned int to, const std::vector<unsigned int>& adjacent, unsigned int begin, unsigned int end)
+    {
+        for (unsigned int i = begin; i < end; i++)
+        {
+            unsigned int t = adjacent[i];
+            if (!live[t])
+                continue;
+            const unsigned int* g = &triangleGroups[3*t];
+            if (g[0] == to || g[1] == to || g[2] == to)
+                continue;
+            const float* before[3];
+            const float* after[3];
+            for (int k = 0; k < 3; k++)
+            {
+                before[k] = position(g[k]);
+                after[k] = g[k] == from ? position(to) : before[k];
+            }
+            double n0[3], n1[3];
+            triangleNormal(before[0], before[1], before[2], n0);
+            triangleNormal(after[0], after[1], after[2], n1);
+            double dot = n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2];
+            double length0 = sqrt(n0[0]*n0[0] + n0[1]*n0[1] + n0[2]*n0[2]);
+            double length1 = sqrt(n1[0]*n1[0] + n1[1]*n1[1] + n1[2]*n1[2]);
+            if (dot <= 0.25 * length0 * length1)
+                return true;
+        }
+        return false;
+    }
+
+    //Vertex of group g standing in for vertex v; picks the member whose normal is closest to v's
+    unsigned int replacement(unsigned int v, unsigned int g)
+    {
+        if (group[v] == g)
+            return v;
+        const float* n = normals + v * stride;
+        unsigned int best = groupMembers[groupFirst[g]];
+        float bestDot = -2;
+        for (unsigned int i = groupFirst[g]; i < groupFirst[g+1]; i++)
+        {
+            const float* m = normals + groupMembers[i] * stride;
+            float dot = n[0]*m[0] + n[1]*m[1] + n[2]*m[2];
+            if (dot > bestDot)
+            {
+                bestDot = dot;
+                best = groupMembers[i];
+            }
+        }
+        return best;
+    }
+
+public:
+    //positions and normals point at the first vertex's; stride is the vertex size in floats
+    MeshSimplifier(const float* positions, const float* normals, unsigned int stride, unsigned int vertexCount,
+                   const unsigned int* indices, unsigned int indexCount)
+        :positions(positions),normals(normals),stride(stride),liveCount(0),maxError(0)
+    {
+        weld(vertexCount);
+        corners.assign(indices, indices + indexCount);
+        triangleGroups.resize(indexCount);
+        live.assign(indexCount / 3, 0);
+        for (unsigned int t = 0; t < live.size(); t++)
+        {
+            for (int k = 0; k < 3; k++)
+                triangleGroups[3*t+k] = group[corners[3*t+k]];
+            const unsigned int* g = &triangleGroups[3*t];
+            live[t] = g[0] != g[1] && g[1] != g[2] && g[0] != g[2];
+            liveCount += live[t];
+        }
+        computeQuadrics();
+    }
+
+    unsigned int triangleCount()
+    {
+        return liveCount;
+    }
+
+    //Collapses edges, cheapest first, until at most targetTriangles remain or nothing more can go
+    //without flipping a triangle. Appends the remaining triangles to result and returns the largest
+    //distance error of any collapse so far, in model units.
+    float simplify(unsigned int targetTriangles, std::vector<unsigned int>& result)
+    {
+        std::vector<Collapse> collapses;
+        std::vector<unsigned char> locked(groupVertex.size());
+        std::vector<unsigned int> adjacentFirst(groupVertex.size() + 1);
+        std::vector<unsigned int> adjacent;
+        while (liveCount > targetTriangles)
+        {
+            //triangles around each group
+            std::fill(adjacentFirst.begin(), adjacentFirst.end(), 0);
+            for (unsigned int t = 0; t < live.size(); t++)
+                if (live[t])
+                    for (int k = 0; k < 3; k++)
+                        adjacentFirst[triangleGroups[3*t+k] + 1]++;
+            for (unsigned int g = 0; g < groupVertex.size(); g++)
+                adjacentFirst[g+1] += adjacentFirst[g];
+            adjacent.resize(adjacentFirst.back());
+            std::vector<unsigned int> filled(adjacentFirst.begin(), adjacentFirst.end() - 1);
+            for (unsigned int t = 0; t < live.size(); t++)
+                if (live[t])
+                    for (int k = 0; k < 3; k++)
+                        adjacent[filled[triangleGroups[3*t+k]]++] = t;
+
+            //cheaper direction of every edge
+            collapses.clear();
+            for (unsigned int t = 0; t < live.size(); t++)
+            {
+                if (!live[t])
+                    continue;
+                for (int k = 0; k < 3; k++)
+                {
+                    //inner edges come up twice; the second copy finds its groups locked
+                    unsigned int a = triangleGroups[3*t+k], b = triangleGroups[3*t+(k+1)%3];
+                    Quadric q = quadrics[a];
+                    q.add(quadrics[b]);
+                    double toB = q.evaluate(position(b));
+                    double toA = q.evaluate(position(a));
+                    Collapse c;
+                    c.from = toB <= toA ? a : b;
+                    c.to = toB <= toA ? b : a;
+                    c.cost = fmax(fmin(toA, toB), 0) / fmax(q.weight, 1e-12);
+                    collapses.push_back(c);
+                }
+            }
+            std::sort(collapses.begin(), collapses.end());
+
+            //as many collapses as needed, each group taking part in at most one per pass
+            std::fill(locked.begin(), locked.end(), 0);
+            unsigned int performed = 0;
+            for (unsigned int i = 0; i < collapses.size() && liveCount > targetTriangles; i++)
+            {
+                Collapse& c = collapses[i];
+                if (locked[c.from] || locked[c.to])
+                    continue;
+                if (flips(c.from, c.to, adjacent, adjacentFirst[c.from], adjacentFirst[c.from+1]))
+                    continue;
+                locked[c.from] = locked[c.to] = 1;
+                collapsedTo[c.from] = c.to;
+                quadrics[c.to].add(quadrics[c.from]);
+                maxError = fmax(maxError, c.cost);
+                for (unsigned int j = adjacentFirst[c.from]; j < adjacentFirst[c.from+1]; j++)
+                {
+                    unsigned int t = adjacent[j];
+                    if (!live[t])
+                        continue;
+                    unsigned int* g = &triangleGroups[3*t];
+                    for (int k = 0; k < 3; k++)
+                        if (g[k] == c.from)
+                            g[k] = c.to;
+                    if (g[0] == g[1] || g[1] == g[2] || g[0] == g[2])
+                    {
+                        live[t] = 0;
+                        liveCount--;
+                    }
+                }
+                performed++;
+            }
+            if (performed == 0)
+                break;
+        }
+
+        for (unsigned int t = 0; t < live.size(); t++)
+        {
+            if (!live[t])
+                continue;
+            for (int k = 0; k < 3; k++)
+                result.push_back(replacement(corners[3*t+k], find(triangleGroups[3*t+k])));
+        }
+        return sqrt(maxError);
+    }
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <OpenGL/gl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+
+//Full mip chain of an image, RGBA8 at every level, built with a 2x2 box filter at import time.
+//The chain is cached next to the image as <image>.mips so later runs skip decoding and filtering;
+//the cache is rebuilt whenever the image's size or modification time no longer match.
+class MipChain
+{
+public:
+    struct Level
+    {
+        int width;
+        int height;
+        std::vector<unsigned char> pixels;
+    };
+
+    //.mips layout: this header, then each level's pixels in order, largest first
+    struct CacheHeader
+    {
+        char magic[4];          // "MIPS"
+        uint32_t version;
+        uint32_t levelCount;
+        uint32_t width;
+        uint32_t height;
+        int64_t sourceSize;     // of the image the chain was built from
+        int64_t sourceTime;
+    };
+
+    static const uint32_t cacheVersion = 1;
+    static const uint32_t maxSize = 16384;     // larger than any texture GL takes; bigger headers are garbage
+
+    std::vector<Level> levels;
+    bool fromCache;
+
+private:
+    //One output row of the box filter; a and b are the two source rows, x in [begin, end)
+    static void downsampleRow(const unsigned char* a, const unsigned char* b, unsigned char* out,
+                              int sourceWidth, int begin, int end)
+    {
+        for (int x = begin; x < end; x++)
+        {
+            int x0 = 2 * x;
+            int x1 = x0 + 1 < sourceWidth ? x0 + 1 : x0;
+            for (int c = 0; c < 4; c++)
+                out[4*x+c] = (a[4*x0+c] + a[4*x1+c] + b[4*x0+c] + b[4*x1+c] + 2) >> 2;
+        }
+    }
+
+    //Halves a level; odd edges repeat their last row or column
+    static void downsample(const Level& source, Level& level)
+    {
+        level.width = source.width > 1 ? source.width / 2 : 1;
+        level.height = source.height > 1 ? source.height / 2 : 1;
+        level.pixels.resize(level.width * level.height * 4);
+        for (int y = 0; y < level.height; y++)
+        {
+            int y0 = 2 * y;
+            int y1 = y0 + 1 < source.height ? y0 + 1 : y0;
+            const unsigned char* a = &source.pixels[y0 * source.width * 4];
+            const unsigned char* b = &source.pixels[y1 * source.width * 4];
+            unsigned char* out = &level.pixels[y * level.width * 4];
+            int x = 0;
+#ifdef __SSE2__
+            //four output pixels per iteration from eight source pixels of each row
+            if (source.width > 1)
+                for (; x + 4 <= level.width && 2 * x + 8 <= source.width; x += 4)
+                {
+                    __m128i zero = _mm_setzero_si128();
+                    __m128i a0 = _mm_loadu_si128((const __m128i*)(a + 8 * x));
+                    __m128i a1 = _mm_loadu_si128((const __m128i*)(a + 8 * x + 16));
+                    __m128i b0 = _mm_loadu_si128((const __m128i*)(b + 8 * x));
+                    __m128i b1 = _mm_loadu_si128((const __m128i*)(b + 8 * x + 16));
+                    //vertical sums in 16 bits, two pixels per register
+                    __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+                    __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+                    __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+                    __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+                    //horizontal pairs: left pixels of each pair plus right pixels
+                    __m128i h0 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+                    __m128i h1 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+                    __m128i round = _mm_set1_epi16(2);
+                    h0 = _mm_srli_epi16(_mm_add_epi16(h0, round), 2);
+                    h1 = _mm_srli_epi16(_mm_add_epi16(h1, round), 2);
+                    _mm_storeu_si128((__m128i*)(out + 4 * x), _mm_packus_epi16(h0, h1));
+                }
+#endif
+            downsampleRow(a, b, out, source.width, x, level.width);
+        }
+    }
+
+    static bool sourceInfo(const char* filename, int64_t& size, int64_t& time)
+    {
+        struct stat info;
+        if (stat(filename, &info) != 0)
+            return false;
+        size = info.st_size;
+        time = info.st_mtime;
+        return true;
+    }
+
+    //Reads a chain cached by saveCache(). The header is checked against the file's length before
+    //anything is allocated from it; a stale or damaged cache is deleted so import() rebuilds it.
+    bool loadCache(const char* filename, int64_t sourceSize, int64_t sourceTime)
+    {
+        FILE* file = fopen(filename, "rb");
+        if (file == NULL)
+            return false;
+        CacheHeader header;
+        bool ok = fread(&header, sizeof(header), 1, file) == 1
+            && memcmp(header.magic, "MIPS", 4) == 0
+            && header.version == cacheVersion
+            && header.sourceSize == sourceSize && header.sourceTime == sourceTime
+            && header.width >= 1 && header.width <= maxSize && header.height >= 1 && header.height <= maxSize;
+        if (ok)
+        {
+            //build() always goes down to 1x1, so the sizes give both the level count and the length
+            uint32_t levelCount = 0;
+            uint64_t bytes = 0;
+            for (uint32_t width = header.width, height = header.height; ; width = width > 1 ? width / 2 : 1, height = height > 1 ? height / 2 : 1)
+            {
+                levelCount++;
+                bytes += (uint64_t)width * height * 4;
+                if (width == 1 && height == 1)
+                    break;
+            }
+            long length = -1;
+            if (fseek(file, 0, SEEK_END) == 0)
+                length = ftell(file);
+            ok = header.levelCount == levelCount && length >= 0 && (uint64_t)length == sizeof(header) + bytes
+                && fseek(file, sizeof(header), SEEK_SET) == 0;
+        }
+        if (ok)
+        {
+            levels.resize(header.levelCount);
+            int width = header.width;
+            int height = header.height;
+            for (unsigned int i = 0; i < levels.size() && ok; i++)
+            {
+                levels[i].width = width;
+                levels[i].height = height;
+                levels[i].pixels.resize(width * height * 4);
+                ok = fread(levels[i].pixels.data(), 1, levels[i].pixels.size(), file) == levels[i].pixels.size();
+                width = width > 1 ? width / 2 : 1;
+                height = height > 1 ? height / 2 : 1;
+            }
+        }
+        fclose(file);
+        if (!ok)
+        {
+            levels.clear();
+            remove(filename);
+        }
+        return ok;
+    }
+
+    void saveCache(const char* filename, int64_t sourceSize, int64_t sourceTime)
+    {
+        FILE* file = fopen(filename, "wb");
+        if (file == NULL)
+            return;     // read-only asset folder: just rebuild next time
+        CacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "MIPS", 4);
+        header.version = cacheVersion;
+        header.levelCount = levels.size();
+        header.width = levels[0].width;
+        header.height = levels[0].height;
+        header.sourceSize = sourceSize;
+        header.sourceTime = sourceTime;
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        for (unsigned int i = 0; i < levels.size() && ok; i++)
+            ok = fwrite(levels[i].pixels.data(), 1, levels[i].pixels.size(), file) == levels[i].pixels.size();
+        fclose(file);
+        if (!ok)
+            remove(filename);
+    }
+
+public:
+    MipChain():fromCache(false){}
+
+    //Level 0 from decoded stb_image pixels (1 to 4 components), then every smaller level down to 1x1
+    void build(const unsigned char* data, int width, int height, int components)
+    {
+        levels.clear();
+        levels.resize(1);
+        Level& base = levels[0];
+        base.width = width;
+        base.height = height;
+        base.pixels.resize(width * height * 4);
+        for (int i = 0; i < width * height; i++)
+        {
+            const unsigned char* in = data + i * components;
+            unsigned char* out = &base.pixels[4 * i];
+            if (components >= 3)
+            {
+                out[0] = in[0]; out[1] = in[1]; out[2] = in[2];
+            }
+            else
+                out[0] = out[1] = out[2] = in[0];
+            out[3] = components == 4 ? in[3] : components == 2 ? in[1] : 255;
+        }
+        while (levels.back().width > 1 || levels.back().height > 1)
+        {
+            levels.push_back(Level());
+            downsample(levels[levels.size() - 2], levels.back());
+        }
+    }
+
+    //Reads the cached chain of an image, or decodes and filters the image and refreshes the cache.
+    //Thread safe apart from two threads importing the same image.
+    bool import(const char* filename)
+    {
+        std::string cache = std::string(filename) + ".mips";
+        int64_t size = 0, time = 0;
+        bool sourceExists = sourceInfo(filename, size, time);
+        fromCache = sourceExists && loadCache(cache.c_str(), size, time);
+        if (fromCache)
+            return true;
+
+        int width, height, components;
+        unsigned char* data = stbi_load(filename, &width, &height, &components, 0);
+        if (data == NULL)
+            return false;
+        build(data, width, height, components);
+        stbi_image_free(data);
+        saveCache(cache.c_str(), size, time);
+        return true;
+    }
+
+    bool usesMipmaps(GLint filtering)
+    {
+        return filtering == GL_NEAREST_MIPMAP_NEAREST || filtering == GL_LINEAR_MIPMAP_NEAREST
+            || filtering == GL_NEAREST_MIPMAP_LINEAR || filtering == GL_LINEAR_MIPMAP_LINEAR;
+    }
+
+    //Uploads the levels the filter needs into the bound texture and sets the filters
+    void upload(GLint filtering)
+    {
+        int levelCount = usesMipmaps(filtering) ? levels.size() : 1;
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        for (int i = 0; i < levelCount; i++)
+            glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, levels[i].width, levels[i].height, 0, GL_RGBA, GL_UNSIGNED_BYTE, levels[i].pixels.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filtering);
+        bool nearest = filtering == GL_NEAREST || filtering == GL_NEAREST_MIPMAP_NEAREST || filtering == GL_NEAREST_MIPMAP_LINEAR;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, nearest ? GL_NEAREST : GL_LINEAR);
+    }
+
+    bool isEmpty()
+    {
+        return levels.empty();
+    }
+};
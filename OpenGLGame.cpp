@@ -1,6 +1,7 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
 // Needed on MsWindows
@@ -20,9 +21,33 @@
 #include "Mesh.h"
 #include "Mesh.cpp"
 #include "stb_image.c"
+#include "SpatialHash.h"
+#include "EntityStore.h"
+#include "ThreadPool.h"
+#include "MeshGeometry.h"
+#include "InstancedRenderer.h"
+#include "RenderState.h"
+#include "Frustum.h"
+#include "CullingBVH.h"
+#include "TriangleBVH.h"
+#include "ShadowCache.h"
+#include "MipChain.h"
+#include "AssetLoader.h"
+#include "Profiler.h"
+#include "InputRecording.h"
+#include "WorldStreamer.h"
+#include "Heightfield.h"
+#include "Terrain.h"
+#include "Arena.h"
 #include <vector>
+#include <map>
+#include <unordered_set>
+#include <algorithm>
+#include <string>
+#include <chrono>
 
 extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
 
 class LightSource
 {
@@ -83,6 +108,12 @@ public:
     }
 };
 
+// All state changes made while drawing the scene go through this cache
+GLStateCache glState;
+
+// Phase timings of the last frames, see Profiler.h
+Profiler profiler;
+
 class Material
 {
 public:
@@ -107,55 +138,107 @@ public:
             glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 128.0f);
     }
     
+    // Applies the material unless it is the one applied last
+    void bind()
+    {
+        if (glState.useMaterial(this))
+            apply();
+    }
+    
+    virtual bool hasTexture()
+    {
+        return false;
+    }
+    
+    virtual GLuint getTexture()
+    {
+        return 0;
+    }
+    
+};
+
+// GL textures by file and filtering mode; each image is decoded and uploaded once
+class TextureCache
+{
+    std::map<std::pair<std::string, GLint>, GLuint> textures;
+    
+    GLuint upload(MipChain& mips, GLint filtering)
+    {
+        GLuint textureName;
+        glGenTextures(1, &textureName);  // id generation
+        glBindTexture(GL_TEXTURE_2D, textureName);      // binding
+        
+        // uploads level by level; filtering is part of the texture object, so it is set once here rather than on every apply
+        mips.upload(filtering);
+        glState.forgetTexture();
+        
+        return textureName;
+    }
+    
+public:
+    GLuint get(const char* filename, GLint filtering)
+    {
+        std::pair<std::string, GLint> key(filename, filtering);
+        std::map<std::pair<std::string, GLint>, GLuint>::iterator i = textures.find(key);
+        if (i != textures.end())
+            return i->second;
+        
+        MipChain mips;
+        GLuint textureName = 0;
+        if (mips.import(filename))
+            textureName = upload(mips, filtering);
+        textures[key] = textureName;
+        return textureName;
+    }
+    
+    bool contains(const char* filename, GLint filtering = GL_LINEAR_MIPMAP_LINEAR)
+    {
+        return textures.count(std::make_pair(std::string(filename), filtering)) > 0;
+    }
+    
+    // Uploads a mip chain imported elsewhere (see AssetLoader); must run on the GL context thread
+    void insert(const char* filename, GLint filtering, MipChain& mips)
+    {
+        std::pair<std::string, GLint> key(filename, filtering);
+        if (textures.count(key))
+            return;
+        textures[key] = mips.isEmpty() ? 0 : upload(mips, filtering);
+    }
 };
 
+TextureCache textureCache;
+
 class TexturedMaterial : public Material
 {
 protected:
-    GLuint textureName;
+    GLuint textureName = 0;
 public:
     TexturedMaterial(const char* filename,
                      GLint filtering = GL_LINEAR_MIPMAP_LINEAR
                      ){
-        unsigned char* data;
-        int width;
-        int height;
-        int nComponents = 4;
-        
-        data = stbi_load(filename, &width, &height, &nComponents, 0);
-        
-        if(data == NULL) return;
-        
-        glGenTextures(1, &textureName);  // id generation
-        glBindTexture(GL_TEXTURE_2D, textureName);      // binding
-        
-        if(nComponents == 4)
-            
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data); //uploading
-        
-        else if(nComponents == 3)
-            
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data); //uploading
-
-        
-        delete data;
+        textureName = textureCache.get(filename, filtering);
     }
     
     void apply()
     {
         Material::apply();
         
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glEnable(GL_TEXTURE_2D);
+        glState.enable(GL_BLEND);
+        glState.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glState.enable(GL_TEXTURE_2D);
         
-        glBindTexture(GL_TEXTURE_2D, textureName);
-        glTexParameteri(GL_TEXTURE_2D,
-                        GL_TEXTURE_MIN_FILTER,GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D,
-                        GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-        glTexEnvi(GL_TEXTURE_ENV,
-                  GL_TEXTURE_ENV_MODE, GL_REPLACE);
+        glState.bindTexture(textureName);
+        glState.texEnvMode(GL_REPLACE);
+    }
+    
+    bool hasTexture()
+    {
+        return true;
+    }
+    
+    GLuint getTexture()
+    {
+        return textureName;
     }
 };
 
@@ -171,6 +254,8 @@ public:
     
     float fov;
     float aspect;
+    float nearPlane = 0.1;
+    float farPlane = 500;
     
     float2 lastMousePos;
     float2 mouseDelta;
@@ -208,17 +293,25 @@ public:
     {
         glMatrixMode(GL_PROJECTION);
         glLoadIdentity();
-        gluPerspective(fov /3.14*180, aspect, 0.1, 500);
+        gluPerspective(fov /3.14*180, aspect, nearPlane, farPlane);
         glMatrixMode(GL_MODELVIEW);
         glLoadIdentity();
         gluLookAt(eye.x, eye.y, eye.z, lookAt.x, lookAt.y, lookAt.z, 0.0, 1.0, 0.0);
     }
     
+    //The view volume apply() sets up, for culling
+    Frustum getFrustum()
+    {
+        Frustum frustum;
+        frustum.set(eye, lookAt, float3(0, 1, 0), fov / 3.14 * 3.14159265, aspect, nearPlane, farPlane);
+        return frustum;
+    }
+    
     void altApply(float a, float b, float c, float d, float e, float f)
     {
         glMatrixMode(GL_PROJECTION);
         glLoadIdentity();
-        gluPerspective(fov /3.14*180, aspect, 0.1, 500);
+        gluPerspective(fov /3.14*180, aspect, nearPlane, farPlane);
         glMatrixMode(GL_MODELVIEW);
         glLoadIdentity();
         gluLookAt(a,b,c,d,e,f,0.0, 1.0, 0.0);
@@ -238,6 +331,7 @@ public:
     
     void move(float dt, std::vector<bool>& keysPressed)
     {
+        ProfileScope scope(profiler, "Camera::move");
         if(keysPressed.at('w'))
             eye += ahead * dt * 20;
         if(keysPressed.at('s'))
@@ -292,39 +386,169 @@ public:
     
 };
 
+//Axis aligned box plus enclosing sphere
+class Bounds
+{
+public:
+    float3 min;
+    float3 max;
+    float3 center;
+    float radius;
+    
+    Bounds():radius(0){}
+    
+    //Box and sphere around a point set, computed in two passes over the points
+    static Bounds of(std::vector<float3*>& points)
+    {
+        Bounds b;
+        if (points.empty())
+            return b;
+        b.min = b.max = *points[0];
+        for (unsigned int i = 1; i<points.size(); i++)
+        {
+            float3 p = *points[i];
+            b.min = float3(fminf(b.min.x, p.x), fminf(b.min.y, p.y), fminf(b.min.z, p.z));
+            b.max = float3(fmaxf(b.max.x, p.x), fmaxf(b.max.y, p.y), fmaxf(b.max.z, p.z));
+        }
+        b.center = (b.min + b.max) * 0.5;
+        float radius2 = 0;
+        for (unsigned int i = 0; i<points.size(); i++)
+        {
+            float d2 = (*points[i] - b.center).norm2();
+            if (d2>radius2)
+                radius2 = d2;
+        }
+        b.radius = sqrtf(radius2);
+        return b;
+    }
+    
+    //Bounds stored with the geometry (in the .mbin header when it was mapped)
+    static Bounds of(MeshGeometry* geometry)
+    {
+        Bounds b;
+        b.min = geometry->boundsMin;
+        b.max = geometry->boundsMax;
+        b.center = (b.min + b.max) * 0.5;
+        b.radius = geometry->boundsRadius;
+        return b;
+    }
+};
+
+//Local space bounds of a mesh, computed once when the first instance of it is created.
+//Taken from the geometry's contiguous arrays when there is one; the skeleton Mesh scatters its
+//positions over the heap, so it is only walked in headless runs without a .mbin.
+std::map<const void*, Bounds> meshBoundsCache;
+
+const Bounds& getMeshBounds(Mesh* mesh, MeshGeometry* geometry)
+{
+    const void* key = geometry ? (const void*)geometry : (const void*)mesh;
+    std::map<const void*, Bounds>::iterator i = meshBoundsCache.find(key);
+    if (i == meshBoundsCache.end())
+        i = meshBoundsCache.insert(std::make_pair(key, geometry ? Bounds::of(geometry) : Bounds::of(mesh->positions))).first;
+    return i->second;
+}
+
+//Drops the bounds of a mesh that is about to be freed, before its address can be reused
+void forgetMeshBounds(Mesh* mesh, MeshGeometry* geometry)
+{
+    meshBoundsCache.erase(mesh);
+    meshBoundsCache.erase(geometry);
+}
+
+EntityStore entities;
+
+// Draw meshes from GL buffer objects; cleared for the immediate mode fallback
+bool useBufferObjects = true;
+// Parse the skeleton Meshes at load; only the immediate mode path (-immediate, -frame-bench) draws them
+bool loadImmediateMeshes = false;
+// Group instances of the same mesh and material into one instanced draw call
+bool useInstancing = true;
+// Bake the shadows of static objects into one cached buffer instead of drawing them every frame
+bool useShadowCache = true;
+// Shadows only show a silhouette, so they are drawn from this level of detail or coarser
+int shadowProxyLod = 2;
+
+// Textures and meshes are read from here, relative to the working directory unless -assets dir or
+// the GAME_ASSETS environment variable say otherwise
+std::string assetRoot = getenv("GAME_ASSETS") ? getenv("GAME_ASSETS") : "assets/";
+
+std::string assetPath(const char* name)
+{
+    if (!assetRoot.empty() && assetRoot[assetRoot.size() - 1] != '/')
+        return assetRoot + "/" + name;
+    return assetRoot + name;
+}
+
+// -world dir: trees are streamed from a tiled world around the avatar instead of the built-in layout
+const char* worldDirectory = 0;
+// tiles instantiated around the avatar's tile, one ring more is read ahead
+int streamRadius = 2;
+// -terrain-height H, -terrain-seed N: the hills outside the flat play area around the origin
+float terrainHeight = 60;
+unsigned int terrainSeed = 1;
+
 class Object
 {
 protected:
-    Material* material;
-    float3 scaleFactor;
-    float3 position;
-    float3 orientationAxis;
-    float orientationAngle;
+    unsigned int entity;
+    
+    // transform and render state live in the entity store, these are views into it
+    float3& position() { return entities.position[entity]; }
+    float3& scaleFactor() { return entities.scaleFactor[entity]; }
+    float3& orientationAxis() { return entities.orientationAxis[entity]; }
+    float& orientationAngle() { return entities.orientationAngle[entity]; }
+    void markTransformChanged()
+    {
+        entities.markTransformDirty(entity);
+        if (entities.isStatic(entity))
+            entities.staticsVersion++;
+    }
 public:
-    Object(Material* material):material(material),orientationAngle(0.0f),scaleFactor(1.0,1.0,1.0),orientationAxis(0.0,1.0,0.0){}
-    virtual ~Object(){}
+    Object(Material* material)
+    {
+        entity = entities.createEntity(this, material);
+    }
+    virtual ~Object()
+    {
+        entities.destroyEntity(entity);
+    }
+    // a jump, not a move: a body's swept path for collisions is carried along, not stretched
     Object* translate(float3 offset){
-        position += offset; return this;
+        position() += offset;
+        if (entities.bodyOf[entity] >= 0)
+            entities.previousPosition[entities.bodyOf[entity]] += offset;
+        markTransformChanged(); return this;
     }
     Object* scale(float3 factor){
-        scaleFactor *= factor; return this;
+        scaleFactor() *= factor; markTransformChanged(); return this;
     }
     Object* rotate(float angle){
-        orientationAngle += angle; return this;
+        orientationAngle() += angle; markTransformChanged(); return this;
+    }
+    
+    //Takes a local space point to world space through the cached world matrix, like draw() does
+    float3 transformPoint(float3 p)
+    {
+        entities.updateTransform(entity);
+        return entities.transformPoint(entity, p);
     }
-    virtual void draw()
+    
+    //Hangs this object off parent: from now on its position, scale and rotation are relative to the
+    //parent's and it follows the parent around. Destroying the parent lets go of it again.
+    Object* attachTo(Object* parent)
     {
-        material->apply();
-        // apply scaling, translation and orientation
-        glMatrixMode(GL_MODELVIEW);
-        glPushMatrix();
-        glTranslatef(position.x, position.y, position.z);
-        glRotatef(orientationAngle, orientationAxis.x, orientationAxis.y, orientationAxis.z);
-        glScalef(scaleFactor.x, scaleFactor.y, scaleFactor.z);
-        drawModel();
-        glPopMatrix();
+        entities.attach(entity, parent->entity);
+        entities.staticsVersion++;  // hanging off a body or not decides whether it is static
+        markTransformChanged(); return this;
+    }
+    Object* detach()
+    {
+        entities.detach(entity);
+        entities.staticsVersion++;  // hanging off a body or not decides whether it is static
+        markTransformChanged(); return this;
     }
     
+    virtual void draw();
     virtual void drawModel()=0;
     virtual void move(double t, double dt){}
     virtual bool control(std::vector<bool>& keysPressed, std::vector<Object*>& spawn, std::vector<Object*>& objects){return false;}
@@ -335,68 +559,190 @@ public:
         return false;
     }
     
-    virtual void drawShadow(float3 lightDir)
+    virtual void drawShadow(float3 lightDir);
+    float3 getPosition()
     {
-        
-        glMatrixMode(GL_MODELVIEW);
-        glPushMatrix();
-
-        glTranslatef(0, 0.01, 0);
-        glScalef(1, 0.01, 1);
-        
-        glTranslatef(position.x, position.y, position.z);
-        glRotatef(orientationAngle, orientationAxis.x, orientationAxis.y, orientationAxis.z);
-        glScalef(scaleFactor.x, scaleFactor.y, scaleFactor.z);
-        
-        float shear[] = {
-            1, 0, 0, 0,
-            lightDir.x/lightDir.y, 1, lightDir.z/lightDir.y, 0,
-            0, 0, 1, 0,
-            0, 0, 0, 1 };
-        glMultMatrixf(shear);
-        
-        
-        drawModel();
-        glPopMatrix();
+        return position();
     }
-    float3 getPosition()
+    
+    float3 getWorldPosition()
+    {
+        return transformPoint(float3(0,0,0));
+    }
+    
+    unsigned int getEntity()
     {
-        return position;
+        return entity;
     }
     
     void changeMaterial(Material* mat)
     {
-        material = mat;
+        entities.material[entity] = mat;
     }
 };
 
+// Level of detail of entity e's shadow proxy
+int entityShadowLod(unsigned int e)
+{
+    MeshGeometry* geometry = entities.geometry[e];
+    if (!geometry)
+        return 0;
+    return std::max((int)entities.lod[e], std::min(shadowProxyLod, (int)geometry->lods.size() - 1));
+}
+
+// Render system: submits entity e from the store's transform and render arrays;
+// lod picks a geometry level other than the entity's current one
+void drawEntityModel(unsigned int e, int lod = -1)
+{
+    if (entities.geometry[e] && (useBufferObjects || !entities.mesh[e]))
+        entities.geometry[e]->draw(lod < 0 ? entities.lod[e] : lod);
+    else if (entities.mesh[e])
+        entities.mesh[e]->draw();
+    else
+        entities.owner[e]->drawModel();
+}
+
+// Moves a local space bounding sphere of entity e into world space with its cached world matrix
+void entityTransformSphere(unsigned int e, float3 localCenter, float localRadius, float3& center, float& radius)
+{
+    center = entities.transformPoint(e, localCenter);
+    radius = localRadius * entities.worldScale[e];
+}
+
+// World space bounding sphere of entity e; false for unbounded entities, which are never culled
+bool entityWorldSphere(unsigned int e, float3& center, float& radius)
+{
+    if (entities.sphereRadius[e] < 0)
+        return false;
+    entityTransformSphere(e, entities.sphereCenter[e], entities.sphereRadius[e], center, radius);
+    return true;
+}
+
+// World space point p, or direction when point is false, in the model space of entity e: the inverse
+// of its world matrix
+float3 entityToModel(unsigned int e, float3 p, bool point = true)
+{
+    const float* m = &entities.worldMatrix[16 * e];
+    if (point)
+        p = p - float3(m[12], m[13], m[14]);
+    // rows of the inverse 3x3 are the cross products of its columns over the determinant
+    float3 x(m[0], m[1], m[2]);
+    float3 y(m[4], m[5], m[6]);
+    float3 z(m[8], m[9], m[10]);
+    float3 yz = y.cross(z);
+    float inverseDet = 1 / x.dot(yz);
+    return float3(yz.dot(p), z.cross(x).dot(p), x.cross(y).dot(p)) * inverseDet;
+}
+
+// Shadows are flattened onto the ground height under their caster: y' = 0.01 y + 0.99 ground + 0.01
+float shadowPlaneOffset(unsigned int e)
+{
+    float3 position = entities.worldPosition(e);
+    return entities.groundHeight(position.x, position.z) * 0.99f + 0.01f;
+}
+
+// Bounding sphere of the flattened shadow drawEntityShadow draws: the model space shear grows the
+// sphere by at most 1 + |shear offset|, and flattening onto the ground only shrinks it
+bool entityShadowSphere(unsigned int e, float3 lightDir, float3& center, float& radius)
+{
+    if (entities.sphereRadius[e] < 0)
+        return false;
+    float3 local = entities.sphereCenter[e];
+    float a = lightDir.x / lightDir.y;
+    float b = lightDir.z / lightDir.y;
+    local = float3(local.x + local.y * a, local.y, local.z + local.y * b);
+    entityTransformSphere(e, local, entities.sphereRadius[e] * (1 + sqrtf(a*a + b*b)), center, radius);
+    center.y = center.y * 0.01 + shadowPlaneOffset(e);
+    return true;
+}
+
+void drawEntity(unsigned int e)
+{
+    entities.material[e]->bind();
+    // its cached world matrix holds the scaling, orientation and translation
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glMultMatrixf(&entities.worldMatrix[16 * e]);
+    drawEntityModel(e);
+    glPopMatrix();
+}
+
+void drawEntityShadow(unsigned int e, float3 lightDir)
+{
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+
+    glTranslatef(0, shadowPlaneOffset(e), 0);
+    glScalef(1, 0.01, 1);
+    glMultMatrixf(&entities.worldMatrix[16 * e]);
+    
+    float shear[] = {
+        1, 0, 0, 0,
+        lightDir.x/lightDir.y, 1, lightDir.z/lightDir.y, 0,
+        0, 0, 1, 0,
+        0, 0, 0, 1 };
+    glMultMatrixf(shear);
+    
+    
+    drawEntityModel(e, entityShadowLod(e));
+    glPopMatrix();
+}
+
+void Object::draw()
+{
+    drawEntity(entity);
+}
+
+void Object::drawShadow(float3 lightDir)
+{
+    if (entities.castsShadow[entity])
+        drawEntityShadow(entity, lightDir);
+}
+
+// The terrain as a scene object; it is drawn through the draw queue like everything else, from
+// the view the scene hands it with setView() each frame. Chunks are only made on the first draw,
+// so headless runs keep just the heightfield.
 class Ground : public Object
 {
+    const Heightfield& field;
+    Terrain* terrain;
+    Frustum frustum;
+    float3 eye;
+    float range;
+    float pixelsPerUnit;
+    float maxPixels;
 public:
-    Ground (Material* m):Object(m){}
-
+    Ground (Material* m, const Heightfield& field):Object(m),field(field),terrain(0),range(0),pixelsPerUnit(1),maxPixels(1)
+    {
+        entities.castsShadow[entity] = 0;
+    }
+    
+    ~Ground()
+    {
+        delete terrain;
+    }
+    
+    void setView(const Frustum& frustum, float3 eye, float range, float pixelsPerUnit, float maxPixels)
+    {
+        this->frustum = frustum;
+        this->eye = eye;
+        this->range = range;
+        this->pixelsPerUnit = pixelsPerUnit;
+        this->maxPixels = maxPixels;
+    }
+    
+    Terrain* getTerrain()
+    {
+        return terrain;
+    }
 
     void drawModel()
     {
-        glDisable(GL_LIGHTING);
-        glDisable(GL_TEXTURE_2D);
-        
-        glBegin(GL_QUADS);
-        
-        float3 color (rand()/rand(),rand()/rand(),rand()/rand());
-        
-        glColor3d(0.1, 0.7, 0.3);
-        
-        glVertex3d(-10000,0,-10000);
-        glVertex3d(10000,0,-10000);
-        glVertex3d(10000,0,10000);
-        glVertex3d(-10000,0,10000);
-        
-        glEnd();
-        
-        glEnable(GL_LIGHTING);
-        glEnable(GL_TEXTURE_2D);
-
+        if (!terrain)
+            terrain = new Terrain(field);
+        glState.disable(GL_TEXTURE_2D);
+        terrain->draw(frustum, eye, range, pixelsPerUnit, maxPixels, useBufferObjects);
+        glState.enable(GL_TEXTURE_2D);
     }
     
     virtual void drawShadow(float3 lightDir)
@@ -420,33 +766,63 @@ class MeshInstance : public Object
 {
 protected:
     Mesh* mesh;
-public:
-    MeshInstance(Material* material, Mesh* m):Object(material), mesh(m){}
-    void drawModel()
+    const Bounds& localBounds;
+    Bounds worldBounds;
+    
+    //Moves the cached mesh bounds into world space when the transform has changed
+    void updateBounds()
     {
-        mesh->draw();
-        
+        // the common case, kept small enough to inline: a root whose bounds already cover its matrix
+        if (entities.transformChanged[entity] || entities.transformDirty[entity] || entities.parent[entity] >= 0)
+            rebuildBounds();
     }
     
-    //Next 4 methods not used in this 3D game
-    float3 getCenter()
+    void rebuildBounds()
     {
-        float x = 0;
-        float y = 0;
-        float z = 0;
-        float n = mesh->positions.size();
-        for (int i = 0; i<n; i++)
+        entities.updateTransform(entity);
+        if (!entities.transformChanged[entity])
+            return;
+        entities.transformChanged[entity] = 0;
+        
+        worldBounds.center = entities.transformPoint(entity, localBounds.center);
+        worldBounds.radius = localBounds.radius * entities.worldScale[entity];
+        
+        worldBounds.min = worldBounds.max = entities.transformPoint(entity, localBounds.min);
+        for (int corner = 1; corner<8; corner++)
         {
-            float3* point = mesh->at(i);
-            x +=point->x;
-            y +=point->y;
-            z +=point->z;
+            float3 p = entities.transformPoint(entity, float3(corner & 1 ? localBounds.max.x : localBounds.min.x,
+                                                       corner & 2 ? localBounds.max.y : localBounds.min.y,
+                                                       corner & 4 ? localBounds.max.z : localBounds.min.z));
+            worldBounds.min = float3(fminf(worldBounds.min.x, p.x), fminf(worldBounds.min.y, p.y), fminf(worldBounds.min.z, p.z));
+            worldBounds.max = float3(fmaxf(worldBounds.max.x, p.x), fmaxf(worldBounds.max.y, p.y), fmaxf(worldBounds.max.z, p.z));
         }
+    }
+public:
+    MeshInstance(Material* material, Mesh* m, MeshGeometry* geometry = 0):Object(material), mesh(m), localBounds(getMeshBounds(m, geometry))
+    {
+        entities.mesh[entity] = m;
+        entities.geometry[entity] = geometry;
+        entities.setBoundingSphere(entity, localBounds.center, localBounds.radius);
+    }
+    void drawModel()
+    {
+        if (mesh)
+            mesh->draw();
+        else
+            entities.geometry[entity]->draw(entities.lod[entity]);
         
-        return float3(x/n, y/n, z/n);
     }
     
+    const Bounds& getBounds()
+    {
+        updateBounds();
+        return worldBounds;
+    }
     
+    float3 getCenter()
+    {
+        return getBounds().center;
+    }
     
     float distance(float3 other)
     {
@@ -462,150 +838,135 @@ public:
     
     float getRadius()
     {
-        float radius = 0;
-        float n = mesh->positions.size();
-        for (int i = 0; i<n; i++)
-        {
-            float3 point = *mesh->positions.at(i);
-            float temprad = distance(point);
-            if (temprad>radius)
-                radius = temprad;
-        }
-        return radius;
+        return getBounds().radius;
     }
     
+    // The other object's bounding sphere against this mesh's triangles, after a bounding sphere check
     bool isCollision(Object* other)
     {
         float centers = distance(other->getCenter());
         float radii = getRadius()+other->getRadius();
-        return (centers<radii);
+        if (centers>=radii)
+            return false;
+        MeshGeometry* geometry = entities.geometry[entity];
+        if (!geometry || geometry->bvh.isEmpty())
+            return true;
+        return geometry->bvh.intersectsSphere(entityToModel(entity, other->getCenter()), other->getRadius() / entities.worldScale[entity]);
+    }
+    
+    // Nearest point where the ray origin + t * direction, 0 <= t <= maxT, meets the mesh's triangles;
+    // for picking and line of sight
+    bool intersectRay(float3 origin, float3 direction, float maxT, float& t)
+    {
+        MeshGeometry* geometry = entities.geometry[entity];
+        if (!geometry)
+            return false;
+        entities.updateTransform(entity);
+        TriangleBVH::Hit hit;
+        if (!geometry->bvh.intersectRay(entityToModel(entity, origin), entityToModel(entity, direction, false), maxT, hit))
+            return false;
+        t = hit.t;
+        return true;
     }
 };
 
 
 //Game physics are mainly in this class
+//Its dynamics live in an entity store body and are integrated by EntityStore::integrate
 class Bouncer : public MeshInstance
 {
 protected:
-    float3 velocity;
-    float3 acceleration;
-    float angularVelocity;
-    float restitution;
-    float angularAcceleration;
-    int teapots;
+    int body() { return entities.bodyOf[entity]; }
+    float3& velocity() { return entities.velocity[body()]; }
+    float3& acceleration() { return entities.acceleration[body()]; }
+    float& angularVelocity() { return entities.angularVelocity[body()]; }
+    float& angularAcceleration() { return entities.angularAcceleration[body()]; }
 public:
-    Bouncer(Material* material, Mesh* m):MeshInstance(material, m)
+    Bouncer(Material* material, Mesh* m, MeshGeometry* geometry = 0):MeshInstance(material, m, geometry)
     {
-        velocity = float3 (0,0,0);
-        angularVelocity = 0;
-        restitution = 0.95;
+        entities.createBody(entity);
     }
     
     void reset()
     {
-        velocity = float3 (0,0,0);
-        angularVelocity = 0;
-        angularAcceleration = 0;
-        acceleration = float3(0,0,0);
-        position = float3(0,0,0);
-        orientationAngle = 0;
+        entities.resetBody(body());
     }
     
     void move(double t, double dt)
     {
-        velocity = velocity + acceleration * dt;
-        if(position.y < 0)
-            velocity.y *= -restitution;
-        //velocity.y = 0;
-        position = position + velocity * dt;
-        
-        angularVelocity += angularAcceleration * dt;
-        angularVelocity *= pow (0.5,dt);
-        velocity *= pow (0.2,dt);
-        
-        orientationAngle += angularVelocity * dt;
-        if (size(position)>1000)
-        {
-            reset();
-        }
-    }
-    
-    
-    
-    float size(float3 f)
-    {
-        return sqrtf(f.x*f.x+f.y*f.y+f.z*f.z);
+        int b = body();
+        entities.integrate(dt, b, b+1);
     }
     
     float3 getVelocity()
     {
-        return velocity;
+        return velocity();
     }
     
     void setVelocity(float3 v)
     {
-        velocity = v;
+        velocity() = v;
     }
     
     float3 getAcceleration()
     {
-        return acceleration;
+        return acceleration();
     }
     
     void setAcceleration(float3 v)
     {
-        acceleration = v;
+        acceleration() = v;
     }
 
     
     float getOrientationAngle()
     {
-        return orientationAngle;
+        return orientationAngle();
     }
     
     virtual bool control(std::vector<bool>& keysPressed, std::vector<Object*>& spawn, std::vector<Object*>& objects)
     {
         if (keysPressed.at('h'))
         {
-            angularAcceleration += 10;
+            angularAcceleration() += 10;
         }
         else if (keysPressed.at('k'))
         {
-            angularAcceleration -= 10;
+            angularAcceleration() -= 10;
         }
         else
         {
-            angularAcceleration = 0;
+            angularAcceleration() = 0;
         }
         
         
         if (keysPressed.at(32) && keysPressed.at('u'))
         {
-            acceleration = float3(-cos(orientationAngle*3.14/180)*10, 0, sin(orientationAngle*3.14/180) *10)*8;
+            acceleration() = float3(-cos(orientationAngle()*3.14/180)*10, 0, sin(orientationAngle()*3.14/180) *10)*8;
         }
         else if (keysPressed.at(32) && keysPressed.at('j'))
         {
-            acceleration = float3(cos(orientationAngle*3.14/180) *10, 0, -sin(orientationAngle*3.14/180) *10)*8;
+            acceleration() = float3(cos(orientationAngle()*3.14/180) *10, 0, -sin(orientationAngle()*3.14/180) *10)*8;
         }
         else if (keysPressed.at('u'))
         {
-            acceleration = float3(-cos(orientationAngle*3.14/180)*10, 0, sin(orientationAngle*3.14/180) *10);
+            acceleration() = float3(-cos(orientationAngle()*3.14/180)*10, 0, sin(orientationAngle()*3.14/180) *10);
         }
 
         else if (keysPressed.at('j'))
         {
-            acceleration = float3(cos(orientationAngle*3.14/180) *10, 0, -sin(orientationAngle*3.14/180) *10);
+            acceleration() = float3(cos(orientationAngle()*3.14/180) *10, 0, -sin(orientationAngle()*3.14/180) *10);
         }
         else
         {
-            acceleration = float3(0,0,0);
+            acceleration() = float3(0,0,0);
         }
         
         
         if (keysPressed.at('f'))
         {
-            angularVelocity = 0;
-            angularAcceleration = 0;
+            angularVelocity() = 0;
+            angularAcceleration() = 0;
         }
         if (keysPressed.at('r'))
         {
@@ -622,7 +983,11 @@ public:
 class Teapot : public Object
 {
 public:
-    Teapot(Material* material):Object(material){}
+    Teapot(Material* material):Object(material)
+    {
+        // glutSolidTeapot(1) fits in a sphere of radius 2.5 around the origin
+        entities.setBoundingSphere(entity, float3(0,0,0), 2.5);
+    }
     void drawModel()
     {
         glutSolidTeapot(1.0f);
@@ -641,136 +1006,414 @@ public:
 class Scene
 {
     Camera camera;
+    // lights, materials and objects live until the scene is unloaded, all in one arena; props of
+    // streamed tiles come and go, and reuse the slots of a pool
+    Arena arena;
+    Pool<MeshInstance> streamedTrees;
     std::vector<LightSource*> lightSources;
     std::vector<Object*> objects;
     std::vector<Material*> materials;
-    Bouncer* avatar;
+    Bouncer* avatar = 0;
     float3 avatarPos;
-    std::vector<float3> treePositions;
-    std::vector<float3> orbPositions;
+    Mesh* treeMesh = 0;
+    MeshGeometry* treeGeometry = 0;
+    Material* treeMaterial;
+    Mesh* tiggerMesh = 0;
+    MeshGeometry* tiggerGeometry = 0;
+    Material* tiggerMaterial;
+    Material* selectedOrbMaterial;
+    Heightfield heightfield;
+    Ground* ground = 0;
+    ThreadPool* physicsPool = 0;
+    InstanceShader* instanceShader = 0;
+    bool instancingChecked = false;
+    // instances are batched by mesh, level of detail and material
+    struct BatchKey
+    {
+        MeshGeometry* geometry;
+        int lod;
+        Material* material;
+        
+        bool operator<(const BatchKey& other) const
+        {
+            if (geometry != other.geometry)
+                return geometry < other.geometry;
+            if (lod != other.lod)
+                return lod < other.lod;
+            return material < other.material;
+        }
+    };
+    typedef std::map<BatchKey, InstanceBatch*> BatchMap;
+    BatchMap batches;
+    BatchMap shadowBatches;
+    
+    // frustum culling: BVHs over the static entities and their shadows, rebuilt when statics change
+    CullingBVH staticBVH;
+    CullingBVH shadowBVH;
+    unsigned int cullVersion = 0;
+    float3 cullLightDir;
+    std::vector<unsigned int> dynamicEntities;
+    std::vector<unsigned int> culledIds;
+    std::vector<unsigned char> visible;
+    std::vector<unsigned char> shadowVisible;
+    ShadowCache staticShadows;
+    
+    // streamed world: the tiles' instances, by tile
+    WorldStreamer* world = 0;
+    struct ChunkInstances
+    {
+        std::vector<MeshInstance*> trees;
+        std::vector<int> gridIds;
+    };
+    std::map<std::pair<int, int>, ChunkInstances> chunkInstances;
+    std::vector<WorldStreamer::Chunk*> activatedChunks;
+    std::vector<WorldStreamer::Chunk*> deactivatedChunks;
+    // A static mesh prop's entity and world bounding sphere, kept so collisions do not rebuild it every tick
+    struct MeshCollider
+    {
+        unsigned int entity;
+        float3 center;
+        float radius;
+    };
+    SpatialHash treeGrid;
+    std::vector<MeshCollider> treeColliders;    // by treeGrid id
+    float treeReach = 0;                        // furthest any tree's mesh reaches from its grid position
+    SpatialHash orbGrid;
+    std::vector<Object*> orbs;
+    std::vector<int> nearby;
     std::vector<int> hitIndices;
     float scaleFactor = 0.5;
     int hitOrbs = 0;
+    bool headless = false;
+    bool reloadHeld = false;
+    std::map<std::string, Material*> materialCache;
+    
+    // Decodes the textures and parses the meshes on a thread pool, so startup takes as long as the
+    // slowest asset rather than the sum; GL uploads happen afterwards on the calling thread.
+    // Textures are only needed when rendering; the geometry also carries the collision BVH, so
+    // headless runs load it too. The immediate mode Mesh is parsed serially after the pool, so it
+    // is only loaded when something will draw it.
+    void loadAssets()
+    {
+        ProfileScope scope(profiler, "Scene::loadAssets");
+        const char* textures[] = { "tigger.png", "tree.png", "bullet.png", "bullet2.png" };
+        
+        AssetLoader loader(profiler);
+        // textures survive level reloads in the texture cache
+        if (!headless)
+            for (unsigned int i = 0; i < sizeof(textures) / sizeof(textures[0]); i++)
+                if (!textureCache.contains(assetPath(textures[i]).c_str()))
+                    loader.requestImage(assetPath(textures[i]).c_str());
+        AssetLoader::MeshAsset* tigger = loader.requestMesh(assetPath("tigger.obj").c_str(), !headless && loadImmediateMeshes);
+        AssetLoader::MeshAsset* tree = loader.requestMesh(assetPath("tree.obj").c_str(), !headless && loadImmediateMeshes);
+        loader.finish();
+        
+        std::vector<AssetLoader::Image*>& images = loader.getImages();
+        for (unsigned int i = 0; i < images.size(); i++)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            AssetLoader::Image* image = images[i];
+            textureCache.insert(image->filename.c_str(), image->filtering, image->mips);
+            image->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        tiggerMesh = tigger->mesh;
+        tiggerGeometry = tigger->geometry;
+        treeMesh = tree->mesh;
+        treeGeometry = tree->geometry;
+        
+        if (!headless)
+            loader.report();
+    }
+    
+    // One shared material per texture file, owned by the scene, so swapping materials at runtime
+    // is a pointer change. Headless runs have no GL context, so textures fall back to plain materials.
+    Material* loadTexturedMaterial(const char* filename)
+    {
+        Material*& material = materialCache[filename];
+        if (!material)
+        {
+            if (headless)
+                material = arena.create<Material>();
+            else
+                material = arena.create<TexturedMaterial>(filename);
+            materials.push_back(material);
+        }
+        return material;
+    }
 public:
-    void initialize()
+    void initialize(bool headless = false)
     {
+        this->headless = headless;
+
         // BUILD YOUR SCENE HERE
         lightSources.push_back(
-                               new DirectionalLight(
+                               arena.create<DirectionalLight>(
                                                     float3(5, 6, 5),
                                                     float3(1, 1, 1)));
 //        lightSources.push_back(
 //                               new PointLight(
 //                                              float3(-1, -1, 1),
 //                                              float3(0.2, 0.1, 0.1)));
-        Material* yellowDiffuseMaterial = new Material();
+        Material* yellowDiffuseMaterial = arena.create<Material>();
         materials.push_back(yellowDiffuseMaterial);
         yellowDiffuseMaterial->kd = float3(1, 1, 0);
-        materials.push_back(new Material());
-        materials.push_back(new Material());
-        materials.push_back(new Material());
-        materials.push_back(new Material());
-        materials.push_back(new Material());
-        materials.push_back(new Material());
+        materials.push_back(arena.create<Material>());
+        materials.push_back(arena.create<Material>());
+        materials.push_back(arena.create<Material>());
+        materials.push_back(arena.create<Material>());
+        materials.push_back(arena.create<Material>());
+        materials.push_back(arena.create<Material>());
         
-        Material* tiggerMaterial = new TexturedMaterial("/Users/jakevitale/Documents/Comp Sci/Computer Graphics/OpenGL/OpenGL/tigger.png");
-        Mesh* tiggerMesh = new Mesh("/Users/jakevitale/Documents/Comp Sci/Computer Graphics/OpenGL/OpenGL/tigger.obj");
+        // decode and parse every asset in parallel, then upload on this thread
+        loadAssets();
         
+        tiggerMaterial = loadTexturedMaterial(assetPath("tigger.png").c_str());
         
-        Material* treeMaterial = new TexturedMaterial("/Users/jakevitale/Documents/Comp Sci/Computer Graphics/OpenGL/OpenGL/tree.png");
-        Mesh* treeMesh = new Mesh("/Users/jakevitale/Documents/Comp Sci/Computer Graphics/OpenGL/OpenGL/tree.obj");
         
-        Material* orbMaterial = new TexturedMaterial("/Users/jakevitale/Documents/Comp Sci/Computer Graphics/OpenGL/OpenGL/bullet.png");
+        treeMaterial = loadTexturedMaterial(assetPath("tree.png").c_str());
         
-        Material* selectedOrbMaterial = new TexturedMaterial("/Users/jakevitale/Documents/Comp Sci/Computer Graphics/OpenGL/OpenGL/bullet2.png");
+        Material* orbMaterial = loadTexturedMaterial(assetPath("bullet.png").c_str());
         
-        Material* groundMaterial = new TexturedMaterial("/Users/jakevitale/Documents/Comp Sci/Computer Graphics/OpenGL/OpenGL/asteroid2.png");
+        selectedOrbMaterial = loadTexturedMaterial(assetPath("bullet2.png").c_str());
         
-         materials.push_back(tiggerMaterial);
-        materials.push_back(treeMaterial);
+        Material* groundMaterial = arena.create<Material>();
+        groundMaterial->kd = float3(0.1, 0.6, 0.25);
+        materials.push_back(groundMaterial);
         
         
-        avatar = new Bouncer(tiggerMaterial, tiggerMesh);
+        
+        avatar = arena.create<Bouncer>(tiggerMaterial, tiggerMesh, tiggerGeometry);
         
         avatarPos = avatar->getPosition();
         
         objects.push_back(((avatar)->scale(float3(0.5,0.5,0.5)))->translate(float3 (0,0,0)));
         
-        objects.push_back(((new MeshInstance(treeMaterial, treeMesh))->scale(float3(0.5,0.5,0.5)))->translate(float3(-50, 0, -50)));
-        
-        objects.push_back(((new MeshInstance(treeMaterial, treeMesh))->scale(float3(0.5,0.5,0.5)))->translate(float3(-50, 0, 50)));
-        
-        objects.push_back(((new MeshInstance(treeMaterial, treeMesh))->scale(float3(0.5,0.5,0.5)))->translate(float3(50, 0, -50)));
-        
-        objects.push_back(((new MeshInstance(treeMaterial, treeMesh))->scale(float3(0.5,0.5,0.5)))->translate(float3(50, 0, 50)));
-        
-        objects.push_back(((new MeshInstance(treeMaterial, treeMesh))->scale(float3(0.5,0.5,0.5)))->translate(float3(-100, 0, -100)));
-        
-        objects.push_back(((new MeshInstance(treeMaterial, treeMesh))->scale(float3(0.5,0.5,0.5)))->translate(float3(-100, 0, 100)));
-        
-        objects.push_back(((new MeshInstance(treeMaterial, treeMesh))->scale(float3(0.5,0.5,0.5)))->translate(float3(100, 0, -100)));
+        if (worldDirectory)
+        {
+            world = new WorldStreamer(streamRadius, streamRadius + 1);
+            if (!world->open(worldDirectory))
+            {
+                printf("no world in %s, using the built-in trees\n", worldDirectory);
+                delete world;
+                world = 0;
+            }
+        }
         
-        objects.push_back(((new MeshInstance(treeMaterial, treeMesh))->scale(float3(0.5,0.5,0.5)))->translate(float3(100, 0, 100)));
+        // the heightfield has no edge, its tiles are made where something asks for a height
+        heightfield.configure(8, terrainHeight, 200, terrainSeed);
+        entities.ground = &heightfield;
         
-        objects.push_back(((new MeshInstance(treeMaterial, treeMesh))->scale(float3(0.5,0.5,0.5)))->translate(float3(-75, 0, 30)));
+        if (world)
+        {
+            entities.resetDistance = fmaxf(entities.resetDistance, world->extent());
+            streamWorld();
+        }
+        else
+        {
+            addTree(float3(-50, 0, -50));
+            addTree(float3(-50, 0, 50));
+            addTree(float3(50, 0, -50));
+            addTree(float3(50, 0, 50));
+            addTree(float3(-100, 0, -100));
+            addTree(float3(-100, 0, 100));
+            addTree(float3(100, 0, -100));
+            addTree(float3(100, 0, 100));
+            addTree(float3(-75, 0, 30));
+        }
 
 
         
-        objects.push_back( (new Teapot(selectedOrbMaterial))->translate(float3(40, 2, 0.5))->scale(float3(3, 4, 2)) );
-        
-        objects.push_back( (new Teapot(orbMaterial))->translate(float3(-40, 2, 0.5))->scale(float3(3, 4, 2)) );
-        
-        objects.push_back( (new Teapot(orbMaterial))->translate(float3(60, 2, 0.5))->scale(float3(3, 4, 2)) );
-        
-        objects.push_back( (new Teapot(orbMaterial))->translate(float3(0, 2, 40.5))->scale(float3(3, 4, 2)) );
-        
-        objects.push_back( (new Teapot(orbMaterial))->translate(float3(0, 2, -30.5))->scale(float3(3, 4, 2)) );
-        
-        objects.push_back( (new Teapot(orbMaterial))->translate(float3(-90, 2, 30.5))->scale(float3(3, 4, 2)) );
-        
-        objects.push_back( (new Teapot(orbMaterial))->translate(float3(10, 2, 0.5))->scale(float3(3, 4, 2)) );
+        addOrb( (arena.create<Teapot>(selectedOrbMaterial))->translate(float3(40, 2, 0.5))->scale(float3(3, 4, 2)) );
         
+        addOrb( (arena.create<Teapot>(orbMaterial))->translate(float3(-40, 2, 0.5))->scale(float3(3, 4, 2)) );
         
+        addOrb( (arena.create<Teapot>(orbMaterial))->translate(float3(60, 2, 0.5))->scale(float3(3, 4, 2)) );
         
+        addOrb( (arena.create<Teapot>(orbMaterial))->translate(float3(0, 2, 40.5))->scale(float3(3, 4, 2)) );
         
+        addOrb( (arena.create<Teapot>(orbMaterial))->translate(float3(0, 2, -30.5))->scale(float3(3, 4, 2)) );
         
+        addOrb( (arena.create<Teapot>(orbMaterial))->translate(float3(-90, 2, 30.5))->scale(float3(3, 4, 2)) );
         
-        for (int i = 1; i<objects.size()-7; i++)
-        {
-            float3 pos = objects[i]->getPosition();
-            treePositions.push_back(pos);
-        }
-        
-        for (int i = objects.size()-7; i<objects.size(); i++)
-        {
-            float3 pos = objects[i]->getPosition();
-            orbPositions.push_back(pos);
-        }
+        addOrb( (arena.create<Teapot>(orbMaterial))->translate(float3(10, 2, 0.5))->scale(float3(3, 4, 2)) );
         
-        std::vector<int> temp(orbPositions.size(),0);
+        std::vector<int> temp(orbs.size(),0);
         hitIndices = temp;
         
         
         
         
         
-        Ground *ground = new Ground(groundMaterial);
+        ground = arena.create<Ground>(groundMaterial, heightfield);
         objects.push_back(ground);
+    }
+    
+    // Trees are static props; their positions live in treeGrid for the collision broad-phase
+    MeshInstance* addTree(float3 position, float size = 0.5, float angle = 0)
+    {
+        MeshInstance* tree = arena.create<MeshInstance>(treeMaterial, treeMesh, treeGeometry);
+        plantTree(tree, position, size, angle);
+        return tree;
+    }
+    
+    // Places a new tree and returns its id in treeGrid
+    int plantTree(MeshInstance* tree, float3 position, float size, float angle)
+    {
+        tree->scale(float3(size,size,size))->rotate(angle)->translate(position);
+        objects.push_back(tree);
+        int id = treeGrid.insert(tree->getPosition());
+        if (id >= (int)treeColliders.size())
+            treeColliders.resize(id + 1);
+        MeshCollider& collider = treeColliders[id];
+        collider.entity = tree->getEntity();
+        collider.center = tree->getCenter();
+        collider.radius = tree->getRadius();
+        treeReach = std::max(treeReach, distance(collider.center, tree->getPosition()) + collider.radius);
+        return id;
+    }
+    
+    // Keeps the world tiles around the avatar instantiated. Which tiles those are depends only on the
+    // avatar's tile, so recorded runs replay the same way however fast the tiles load.
+    void streamWorld()
+    {
+        if (!world)
+            return;
+        ProfileScope scope(profiler, "Scene::streamWorld");
+        activatedChunks.clear();
+        deactivatedChunks.clear();
+        world->update(avatar->getPosition(), activatedChunks, deactivatedChunks);
+        
+        if (!deactivatedChunks.empty())
+        {
+            std::unordered_set<Object*> removed;
+            for (unsigned int i = 0; i < deactivatedChunks.size(); i++)
+            {
+                std::pair<int, int> key(deactivatedChunks[i]->x, deactivatedChunks[i]->z);
+                ChunkInstances& instances = chunkInstances[key];
+                removed.insert(instances.trees.begin(), instances.trees.end());
+                for (unsigned int j = 0; j < instances.gridIds.size(); j++)
+                    treeGrid.remove(instances.gridIds[j]);
+            }
+            objects.erase(std::remove_if(objects.begin(), objects.end(), [&removed](Object* object) { return removed.count(object) > 0; }),
+                          objects.end());
+            for (unsigned int i = 0; i < deactivatedChunks.size(); i++)
+            {
+                std::pair<int, int> key(deactivatedChunks[i]->x, deactivatedChunks[i]->z);
+                ChunkInstances& instances = chunkInstances[key];
+                for (unsigned int j = 0; j < instances.trees.size(); j++)
+                    streamedTrees.destroy(instances.trees[j]);
+                chunkInstances.erase(key);
+            }
+        }
         
-        for (int i = 0; i<treePositions.size(); i++)
-        {
-            float3 pos = treePositions[i];
-        }
-        
+        for (unsigned int i = 0; i < activatedChunks.size(); i++)
+        {
+            WorldStreamer::Chunk* chunk = activatedChunks[i];
+            ChunkInstances& instances = chunkInstances[std::make_pair(chunk->x, chunk->z)];
+            for (unsigned int j = 0; j < chunk->props.size(); j++)
+            {
+                const WorldProp& prop = chunk->props[j];
+                if (prop.type != WorldProp::tree)
+                    continue;
+                // prop heights are above the ground
+                float3 position = prop.position;
+                position.y += heightfield.height(position.x, position.z);
+                MeshInstance* tree = streamedTrees.create(treeMaterial, treeMesh, treeGeometry);
+                instances.trees.push_back(tree);
+                instances.gridIds.push_back(plantTree(tree, position, prop.scale, prop.angle));
+            }
+        }
     }
+    
+    // Orbs are collected in the order they were added; the grid id matches the index in orbs
+    void addOrb(Object* orb)
+    {
+        objects.push_back(orb);
+        orbs.push_back(orb);
+        orbGrid.insert(orb->getPosition());
+    }
+    
+    // Extra tigger-shaped bouncers for physics stress scenes
+    Bouncer* addBouncer(float3 position, float3 velocity)
+    {
+        Bouncer* bouncer = arena.create<Bouncer>(tiggerMaterial, tiggerMesh, tiggerGeometry);
+        bouncer->scale(float3(0.5,0.5,0.5))->translate(position);
+        bouncer->setVelocity(velocity);
+        objects.push_back(bouncer);
+        return bouncer;
+    }
+    
+    Bouncer* getAvatar()
+    {
+        return avatar;
+    }
+    
+    // 0 or 1 steps physics on the calling thread, more splits it across a thread pool. The calling
+    // thread helps out in parallelFor, so n threads take a pool of n-1 workers.
+    void setPhysicsThreads(int threads)
+    {
+        delete physicsPool;
+        physicsPool = threads > 1 ? new ThreadPool(threads - 1) : 0;
+    }
+    // Destroys everything initialize() made, in bulk, so initialize() can load the level again.
+    // The arena and the pool keep their memory for the next load.
+    void unload()
+    {
+        for (std::map<std::pair<int, int>, ChunkInstances>::iterator iChunk = chunkInstances.begin(); iChunk != chunkInstances.end(); ++iChunk)
+            for (unsigned int j = 0; j < iChunk->second.trees.size(); j++)
+                streamedTrees.destroy(iChunk->second.trees[j]);
+        chunkInstances.clear();
+        delete world;
+        world = 0;
+        
+        arena.reset();
+        lightSources.clear();
+        objects.clear();
+        materials.clear();
+        materialCache.clear();
+        orbs.clear();
+        hitIndices.clear();
+        hitOrbs = 0;
+        scaleFactor = 0.5;
+        avatar = 0;
+        ground = 0;
+        treeGrid.clear();
+        treeColliders.clear();
+        treeReach = 0;
+        orbGrid.clear();
+        entities.ground = 0;
+        
+        for (BatchMap::iterator iBatch = batches.begin(); iBatch != batches.end(); ++iBatch)
+            delete iBatch->second;
+        for (BatchMap::iterator iBatch = shadowBatches.begin(); iBatch != shadowBatches.end(); ++iBatch)
+            delete iBatch->second;
+        batches.clear();
+        shadowBatches.clear();
+        staticShadows.clear();
+        dynamicEntities.clear();
+        
+        forgetMeshBounds(treeMesh, treeGeometry);
+        forgetMeshBounds(tiggerMesh, tiggerGeometry);
+        delete treeMesh;
+        delete treeGeometry;
+        delete tiggerMesh;
+        delete tiggerGeometry;
+        treeMesh = tiggerMesh = 0;
+        treeGeometry = tiggerGeometry = 0;
+    }
+    
+    // Level reload: everything the level made goes at once, then it is built again
+    void reload()
+    {
+        unload();
+        initialize(headless);
+    }
+    
     ~Scene()
     {
-        for (std::vector<LightSource*>::iterator iLightSource = lightSources.begin(); iLightSource != lightSources.end(); ++iLightSource)
-            delete *iLightSource;
-        for (std::vector<Material*>::iterator iMaterial = materials.begin(); iMaterial != materials.end(); ++iMaterial)
-            delete *iMaterial;
-        for (std::vector<Object*>::iterator iObject = objects.begin(); iObject != objects.end(); ++iObject)
-            delete *iObject;
+        unload();
+        delete physicsPool;
+        delete instanceShader;
     }
     
 public:
@@ -797,42 +1440,415 @@ public:
                              pos.z+cos(angle-3.14/180-3.14/2)));
     }
     
+private:
+    // Static shadow casters with geometry are drawn from the shadow cache instead of one by one
+    bool isShadowCached(unsigned int e)
+    {
+        return useShadowCache && entities.alive[e] && entities.castsShadow[e] && entities.isStatic(e)
+            && entities.geometry[e] && entities.sphereRadius[e] >= 0;
+    }
+    
+    // Projects the shadow proxies of all cached casters onto the ground, like drawEntityShadow does
+    void rebuildShadowCache(float3 lightDir)
+    {
+        ProfileScope scope(profiler, "Scene::rebuildShadowCache");
+        staticShadows.clear();
+        // every level of a mesh as the positions it uses and triangles indexing them, built once per mesh
+        struct Proxy
+        {
+            std::vector<float3> positions[ShadowCache::levelCount];
+            std::vector<unsigned int> triangles[ShadowCache::levelCount];
+            float error[ShadowCache::levelCount];
+        };
+        std::map<MeshGeometry*, Proxy> proxies;
+        std::vector<int> remap;
+        std::vector<float3> points;
+        float a = lightDir.x / lightDir.y;
+        float b = lightDir.z / lightDir.y;
+        for (unsigned int e=0; e<entities.alive.size(); e++)
+        {
+            if (!isShadowCached(e))
+                continue;
+            MeshGeometry* geometry = entities.geometry[e];
+            std::map<MeshGeometry*, Proxy>::iterator iProxy = proxies.find(geometry);
+            if (iProxy == proxies.end())
+            {
+                Proxy& proxy = proxies[geometry];
+                // the proxy level and the coarser ones after it, as far as the mesh has them
+                for (int level = 0; level < ShadowCache::levelCount; level++)
+                {
+                    int lodIndex = std::min(shadowProxyLod + level, (int)geometry->lods.size() - 1);
+                    const MeshGeometry::Lod& lod = geometry->lods[lodIndex];
+                    remap.assign(geometry->vertexCount, -1);
+                    for (unsigned int i = lod.first; i < lod.first + lod.count; i++)
+                    {
+                        unsigned int v = geometry->indexData[i];
+                        if (remap[v] < 0)
+                        {
+                            const float* p = geometry->vertexData[v].position;
+                            remap[v] = proxy.positions[level].size();
+                            proxy.positions[level].push_back(float3(p[0], p[1], p[2]));
+                        }
+                        proxy.triangles[level].push_back(remap[v]);
+                    }
+                    proxy.error[level] = lod.error;
+                }
+                iProxy = proxies.find(geometry);
+            }
+            const Proxy& proxy = iProxy->second;
+            const float* m = &entities.worldMatrix[16 * e];
+            float offset = shadowPlaneOffset(e);
+            float scale = entities.worldScale[e];
+            for (int level = 0; level < ShadowCache::levelCount; level++)
+            {
+                // sheared along the light, placed, and flattened onto the ground
+                points.clear();
+                for (unsigned int i = 0; i < proxy.positions[level].size(); i++)
+                {
+                    const float3& p = proxy.positions[level][i];
+                    float3 q(p.x + p.y * a, p.y, p.z + p.y * b);
+                    points.push_back(float3(m[0]*q.x + m[4]*q.y + m[8]*q.z + m[12],
+                                            (m[1]*q.x + m[5]*q.y + m[9]*q.z + m[13]) * 0.01 + offset,
+                                            m[2]*q.x + m[6]*q.y + m[10]*q.z + m[14]));
+                }
+                staticShadows.addMesh(points, proxy.triangles[level], entities.worldPosition(e), level, proxy.error[level] * scale);
+            }
+        }
+        staticShadows.finish();
+    }
+    
+    void rebuildCulling(float3 lightDir)
+    {
+        ProfileScope scope(profiler, "Scene::rebuildCulling");
+        std::vector<CullingBVH::Item> spheres;
+        std::vector<CullingBVH::Item> shadows;
+        dynamicEntities.clear();
+        for (unsigned int e=0; e<entities.alive.size(); e++)
+        {
+            if (!entities.alive[e])
+                continue;
+            CullingBVH::Item item;
+            item.id = e;
+            if (!entities.isStatic(e) || !entityWorldSphere(e, item.center, item.radius))
+            {
+                dynamicEntities.push_back(e);
+                continue;
+            }
+            spheres.push_back(item);
+            if (entities.castsShadow[e] && !isShadowCached(e) && entityShadowSphere(e, lightDir, item.center, item.radius))
+                shadows.push_back(item);
+        }
+        staticBVH.build(spheres);
+        shadowBVH.build(shadows);
+        rebuildShadowCache(lightDir);
+        cullVersion = entities.staticsVersion;
+        cullLightDir = lightDir;
+    }
+    
+    // Flags the entities whose bounds, and whose shadows' bounds, intersect the view frustum
+    void cull(const Frustum& frustum, float3 lightDir)
+    {
+        if (cullVersion != entities.staticsVersion || staticBVH.size() + dynamicEntities.size() == 0
+            || (cullLightDir - lightDir).norm2() > 0)
+            rebuildCulling(lightDir);
+        
+        visible.assign(entities.alive.size(), 0);
+        shadowVisible.assign(entities.alive.size(), 0);
+        culledIds.clear();
+        cullTests = staticBVH.cull(frustum, culledIds);
+        for (unsigned int i=0; i<culledIds.size(); i++)
+            visible[culledIds[i]] = 1;
+        culledIds.clear();
+        cullTests += shadowBVH.cull(frustum, culledIds);
+        for (unsigned int i=0; i<culledIds.size(); i++)
+            shadowVisible[culledIds[i]] = 1;
+        
+        // moving and unbounded entities are tested one by one
+        for (unsigned int i=0; i<dynamicEntities.size(); i++)
+        {
+            unsigned int e = dynamicEntities[i];
+            float3 center;
+            float radius;
+            cullTests++;
+            visible[e] = !entityWorldSphere(e, center, radius) || frustum.intersectsSphere(center, radius);
+            if (entities.castsShadow[e])
+                shadowVisible[e] = !entityShadowSphere(e, lightDir, center, radius) || frustum.intersectsSphere(center, radius);
+        }
+        
+        visibleCount = culledCount = shadowVisibleCount = shadowCulledCount = 0;
+        for (unsigned int e=0; e<entities.alive.size(); e++)
+        {
+            if (!entities.alive[e])
+                continue;
+            if (visible[e]) visibleCount++; else culledCount++;
+            if (entities.castsShadow[e])
+            {
+                if (shadowVisible[e]) shadowVisibleCount++; else shadowCulledCount++;
+            }
+        }
+    }
+    
+    // Screen pixels per world unit at distance one
+    float lodPixelsPerUnit()
+    {
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        return viewport[3] / (2 * tanf(camera.fov / 3.14 * 3.14159265 * 0.5f));
+    }
+    
+    // Picks each visible mesh's level of detail from the projected size of the level's error. Going
+    // coarser needs the error to fit 25% under the limit, so objects near a switching distance do
+    // not flip between levels. With a triangle budget the limit adapts until the frame fits it.
+    void selectLods()
+    {
+        float pixelsPerUnit = lodPixelsPerUnit();
+        float maxPixels = lodPixelError * lodScale;
+        
+        trianglesDrawn = 0;
+        for (unsigned int e=0; e<entities.alive.size(); e++)
+        {
+            MeshGeometry* geometry = entities.geometry[e];
+            if (!entities.alive[e] || !geometry || !(visible[e] || shadowVisible[e]))
+                continue;
+            int lod = 0;
+            float3 center;
+            float radius;
+            if (geometry->lods.size() > 1 && entityWorldSphere(e, center, radius))
+            {
+                float scale = entities.worldScale[e];
+                float distance = fmaxf((center - camera.eye).norm() - radius, camera.nearPlane);
+                int current = entities.lod[e] < geometry->lods.size() ? entities.lod[e] : 0;
+                lod = geometry->selectLod(distance, pixelsPerUnit * scale, maxPixels);
+                if (lod > current)
+                    lod = std::max(current, geometry->selectLod(distance, pixelsPerUnit * scale, maxPixels * 0.75f));
+            }
+            entities.lod[e] = lod;
+            if (visible[e])
+                trianglesDrawn += geometry->triangleCount(lod);
+        }
+        
+        if (triangleBudget > 0 && trianglesDrawn > triangleBudget)
+            lodScale *= 1.2f;
+        else if (lodScale > 1 && trianglesDrawn < triangleBudget * 3 / 4)
+            lodScale = fmaxf(1, lodScale / 1.2f);
+    }
+    
+    // Sorts every visible entity with buffer object geometry into the batch of its mesh and material
+    void buildBatches(BatchMap& batchMap, std::vector<unsigned char>& visibleEntities, bool shadowPass)
+    {
+        for (BatchMap::iterator iBatch = batchMap.begin(); iBatch != batchMap.end(); ++iBatch)
+            iBatch->second->matrices.clear();
+        for (unsigned int e=0; e<entities.alive.size(); e++)
+        {
+            if (!entities.alive[e] || !entities.geometry[e] || !visibleEntities[e])
+                continue;
+            int lod = shadowPass ? entityShadowLod(e) : entities.lod[e];
+            BatchKey key = {entities.geometry[e], lod, entities.material[e]};
+            InstanceBatch*& batch = batchMap[key];
+            if (!batch)
+                batch = new InstanceBatch(entities.geometry[e], lod);
+            batch->matrices.resize(batch->matrices.size() + 16);
+            float* m = &batch->matrices[batch->matrices.size() - 16];
+            memcpy(m, &entities.worldMatrix[16 * e], 16 * sizeof(float));
+            // shadow instances are flattened onto the ground under each of them
+            if (shadowPass)
+            {
+                m[1] *= 0.01f;
+                m[5] *= 0.01f;
+                m[9] *= 0.01f;
+                m[13] = m[13] * 0.01f + shadowPlaneOffset(e);
+            }
+        }
+    }
+    
+    // A draw queue item is either a whole instance batch or a single entity
+    struct DrawPayload
+    {
+        InstanceBatch* batch;
+        unsigned int entity;
+    };
+    RenderQueue<DrawPayload> drawQueue;
+    RenderQueue<DrawPayload> shadowQueue;
+    
+    // Fills a draw queue with the batches and every visible entity not covered by one, sorted by texture, material and mesh
+    void buildDrawQueue(RenderQueue<DrawPayload>& queue, BatchMap& batchMap, std::vector<unsigned char>& visibleEntities, bool shadowPass)
+    {
+        queue.clear();
+        if (useBufferObjects)
+        {
+            buildBatches(batchMap, visibleEntities, shadowPass);
+            for (BatchMap::iterator iBatch = batchMap.begin(); iBatch != batchMap.end(); ++iBatch)
+            {
+                if (iBatch->second->count() == 0)
+                    continue;
+                Material* material = iBatch->first.material;
+                DrawPayload payload = {iBatch->second, 0};
+                queue.push(material->getTexture(), material, iBatch->first.geometry, payload);
+            }
+        }
+        for (unsigned int e=0; e<entities.alive.size(); e++)
+        {
+            if (!entities.alive[e] || !visibleEntities[e] || (useBufferObjects && entities.geometry[e]))
+                continue;
+            Material* material = entities.material[e];
+            const void* mesh = entities.mesh[e] ? (const void*)entities.mesh[e] : (const void*)entities.owner[e];
+            DrawPayload payload = {0, e};
+            queue.push(material->getTexture(), material, mesh, payload);
+        }
+        queue.sort();
+    }
+    
+    void drawBatch(InstanceBatch* batch, Material* material, bool shadowPass, const float* shear)
+    {
+        if (instanceShader)
+        {
+            instanceShader->begin(!shadowPass && material->hasTexture(), shadowPass, shear);
+            batch->drawInstanced();
+            instanceShader->end();
+        }
+        else
+            batch->drawEach(shear);
+    }
+    
+public:
+    // culling counters of the last frame
+    int visibleCount = 0;
+    int culledCount = 0;
+    int shadowVisibleCount = 0;
+    int shadowCulledCount = 0;
+    int cullTests = 0;
+    
+    // level of detail: largest error on screen in pixels, an optional triangle budget for the
+    // main pass (0 for none), and the scale the budget currently applies to the error limit
+    float lodPixelError = 1;
+    int triangleBudget = 0;
+    float lodScale = 1;
+    int trianglesDrawn = 0;
+    
+    int shadowChunksDrawn()
+    {
+        return staticShadows.chunksDrawn;
+    }
+    
     void draw()
     {
+        ProfileScope scope(profiler, "Scene::draw");
+        entities.updateTransforms();
+        glState.reset();
+        glState.resetCounters();
+        
         //position.x+cos(orienationangle *3.14/180)*10
         camera.apply();
         unsigned int iLightSource=0;
         for (; iLightSource<lightSources.size(); iLightSource++)
         {
-            glEnable(GL_LIGHT0 + iLightSource);
+            glState.enable(GL_LIGHT0 + iLightSource);
             lightSources.at(iLightSource)->apply(GL_LIGHT0 + iLightSource);
         }
-        for (; iLightSource<GL_MAX_LIGHTS; iLightSource++)
-            glDisable(GL_LIGHT0 + iLightSource);
+        // GL_MAX_LIGHTS is the name of the limit, not the limit itself
+        static GLint maxLights = 0;
+        if (!maxLights)
+            glGetIntegerv(GL_MAX_LIGHTS, &maxLights);
+        for (; iLightSource<(unsigned int)maxLights; iLightSource++)
+            glState.disable(GL_LIGHT0 + iLightSource);
+        
+        if (!instancingChecked)
+        {
+            instancingChecked = true;
+            if (useInstancing && InstanceShader::isSupported())
+            {
+                instanceShader = new InstanceShader();
+                if (!instanceShader->create())
+                {
+                    delete instanceShader;
+                    instanceShader = 0;
+                }
+            }
+        }
         
-        for (unsigned int iObject=0; iObject<objects.size(); iObject++)
-            objects.at(iObject)->draw();
+        float3 lightDir =
+        lightSources.at(0)
+        ->getLightDirAt(float3(0, 0, 0));
         
-        glDisable(GL_LIGHTING);
-        glDisable(GL_TEXTURE_2D);
+        Frustum frustum = camera.getFrustum();
+        cull(frustum, lightDir);
+        selectLods();
+        ground->setView(frustum, camera.eye, camera.farPlane, lodPixelsPerUnit(), lodPixelError * lodScale);
+        buildDrawQueue(drawQueue, batches, visible, false);
+        buildDrawQueue(shadowQueue, shadowBatches, shadowVisible, true);
+        
+        float identity[] = {
+            1, 0, 0, 0,
+            0, 1, 0, 0,
+            0, 0, 1, 0,
+            0, 0, 0, 1 };
+        for (unsigned int i=0; i<drawQueue.items.size(); i++)
+        {
+            DrawPayload& payload = drawQueue.items[i].payload;
+            glState.drawSubmissions++;
+            if (payload.batch)
+            {
+                Material* material = (Material*)drawQueue.items[i].material;
+                material->bind();
+                drawBatch(payload.batch, material, false, identity);
+            }
+            else
+                drawEntity(payload.entity);
+        }
+        
+        drawShadows(frustum, lightDir);
+    }
+    
+    // Flattened shadows: the batched and per-entity casters, then the static cache
+    void drawShadows(const Frustum& frustum, float3 lightDir)
+    {
+        ProfileScope scope(profiler, "Scene::drawShadows");
+        glState.disable(GL_LIGHTING);
+        glState.disable(GL_TEXTURE_2D);
         
         glColor3d(0.0, 0.0, 0.0);
         
-        float3 lightDir =
-        lightSources.at(0)
-        ->getLightDirAt(float3(0, 0, 0));
+        float shear[] = {
+            1, 0, 0, 0,
+            lightDir.x/lightDir.y, 1, lightDir.z/lightDir.y, 0,
+            0, 0, 1, 0,
+            0, 0, 0, 1 };
+        for (unsigned int i=0; i<shadowQueue.items.size(); i++)
+        {
+            DrawPayload& payload = shadowQueue.items[i].payload;
+            if (payload.batch)
+            {
+                glState.drawSubmissions++;
+                glMatrixMode(GL_MODELVIEW);
+                drawBatch(payload.batch, (Material*)shadowQueue.items[i].material, true, shear);
+            }
+            else if (entities.castsShadow[payload.entity])
+            {
+                glState.drawSubmissions++;
+                drawEntityShadow(payload.entity, lightDir);
+            }
+        }
         
-        for (unsigned int iObject=0; iObject<objects.size(); iObject++)
-            objects.at(iObject)->drawShadow(lightDir);
+        // everything static in one go, already flattened in world space
+        staticShadows.draw(frustum, camera.eye, lodPixelsPerUnit(), lodPixelError * lodScale, useBufferObjects);
+        glState.drawSubmissions += staticShadows.drawCalls;
         
-        glEnable(GL_LIGHTING);
-        glEnable(GL_TEXTURE_2D);
+        glState.enable(GL_LIGHTING);
+        glState.enable(GL_TEXTURE_2D);
     }
     
     void move(float t, float dt)
     {
-        for (unsigned int iObject=0; iObject<objects.size(); iObject++)
-            objects.at(iObject)->move(t,dt);
+        ProfileScope scope(profiler, "Scene::move");
+        // before the physics threads start reading the ground
+        heightfield.update();
+        if (physicsPool)
+            physicsPool->parallelFor(0, entities.bodyEntity.size(), 512, [dt](int begin, int end)
+                                     {
+                                         entities.integrate(dt, begin, end);
+                                     });
+        else
+            entities.integrate(dt);
     }
     
     float distance(float3 first, float3 other)
@@ -845,41 +1861,208 @@ public:
         
     }
     
-    void checkCollisions()
+    // Fraction of the way along start -> start+path at which a point first comes within radius of
+    // center, or -1 if it never does during the move. 0 if it starts inside. leave, if given, gets
+    // the fraction at which the point is outside again, past 1 if it still is not by the end.
+    // Solved from the closest approach rather than the quadratic's discriminant, which loses every
+    // digit to cancellation once the move is thousands of times longer than the radius.
+    static float timeOfImpact(float3 start, float3 path, float3 center, float radius, float* leave = 0)
     {
-        avatarPos = avatar->getPosition();
-        
-        int hitIndex = 0;
-        
-        for (int i = 0; i<treePositions.size(); i++)
+        float3 offset = start - center;
+        float a = path.norm2();
+        float closest = a > 0 ? -offset.dot(path) / a : 0;
+        float miss2 = (offset + path*closest).norm2();
+        float halfChord = a > 0 && miss2 < radius*radius ? sqrtf((radius*radius - miss2) / a) : 0;
+        if (leave)
+            *leave = closest + halfChord;
+        if (offset.norm2() < radius*radius)
+            return 0;
+        if (a == 0 || closest <= 0 || miss2 >= radius*radius)
+            return -1;
+        float t = closest - halfChord;
+        return t <= 1 ? fmaxf(t, 0) : -1;
+    }
+    
+    // Earliest fraction of the move start -> start+path at which a sphere first touches the triangles
+    // of a mesh prop, or -1. The bounding spheres rule out most moves. For the rest, a ray along the
+    // path finds where the sphere's center would cross a triangle, and the part of the move inside
+    // the bounding sphere up to there is marched in steps of half the radius through the mesh's BVH.
+    // The step that makes contact is bisected, so the returned point is just short of touching.
+    // However fast the sphere moves, the steps span at most the prop's size, and a sphere too small
+    // to step with is stopped by the ray. touching is set, and -1 returned, for a sphere that starts
+    // and ends the move in contact.
+    static float timeOfImpactWithMesh(const MeshCollider& collider, float3 start, float3 path, float radius, bool& touching)
+    {
+        touching = false;
+        unsigned int e = collider.entity;
+        float3 boundsCenter = collider.center;
+        float boundsRadius = collider.radius;
+        float end;
+        float t = timeOfImpact(start, path, boundsCenter, boundsRadius + radius, &end);
+        MeshGeometry* geometry = entities.geometry[e];
+        if (t < 0)
+            return -1;
+        // without triangles the bounding sphere is all there is to hit
+        if (!geometry || geometry->bvh.isEmpty())
+        {
+            touching = t == 0 && (start + path - boundsCenter).norm() < boundsRadius + radius;
+            return touching ? -1 : t;
+        }
+        const TriangleBVH& bvh = geometry->bvh;
+        float3 localStart = entityToModel(e, start);
+        float3 localPath = entityToModel(e, path, false);
+        float localRadius = radius / entities.worldScale[e];
+        if (t == 0 && bvh.intersectsSphere(localStart, localRadius))
+        {
+            touching = bvh.intersectsSphere(localStart + localPath, localRadius);
+            return -1;
+        }
+        float pathLength = localPath.norm();
+        if (pathLength == 0)
+            return -1;
+        // nothing to touch once the sphere has left the bounding sphere again
+        end = fminf(end, 1);
+        // by the time the center crosses a triangle the sphere has certainly touched it
+        TriangleBVH::Hit hit;
+        if (bvh.intersectRay(localStart, localPath, end, hit))
         {
-            float dist = distance(avatarPos, treePositions[i]);
-            if (dist<14)
+            end = fmaxf(t, hit.t);
+            if (localRadius == 0)
+                return fmaxf(t, hit.t - 0.001f / pathLength);
+        }
+        else if (localRadius == 0)
+            return -1;
+        float stepLength = localRadius * 0.5f;
+        int steps = std::max(1, (int)ceilf(pathLength * (end - t) / stepLength));
+        float step = (end - t) / steps;
+        for (int i = 0; i <= steps; i++)
+        {
+            float current = i < steps ? t + step * i : end;
+            if (!bvh.intersectsSphere(localStart + localPath * current, localRadius))
+                continue;
+            if (i == 0)
+                return t;
+            float low = current - step;
+            float high = current;
+            for (int j = 0; j < 8; j++)
             {
-                avatar->setAcceleration(avatar->getAcceleration()*1);
-                avatar->setVelocity(avatar->getVelocity()*-2);
-                
+                float middle = (low + high) * 0.5f;
+                if (bvh.intersectsSphere(localStart + localPath * middle, localRadius))
+                    high = middle;
+                else
+                    low = middle;
             }
+            return low;
         }
+        return -1;
+    }
+    
+    // Bounces bodies [begin, end) off the trees they touch, testing the body's bounding sphere
+    // against the tree meshes' triangles.
+    // The whole path a body moved along this tick is tested, not only where it ended up, so a fast
+    // body or a long tick can not carry it through a tree. A body that reaches a tree is put back
+    // at the point of impact, ready to bounce away, and the rest of its move is dropped; one that
+    // already started inside bounces the old way, once for each tree it is in.
+    // A body's response depends only on its own state and the static trees, so whichever thread
+    // owns a body finds and resolves its contacts in the same order as the serial path does,
+    // and the result is bit for bit the same for any thread count.
+    void collideBodiesWithTrees(int begin, int end, std::vector<int>& candidates)
+    {
+        for (int b = begin; b<end; b++)
+        {
+            unsigned int e = entities.bodyEntity[b];
+            float3 start = entities.previousPosition[b];
+            float3 path = entities.position[e] - start;
+            // how far the body's sphere reaches from its position, without transforming anything; a lone
+            // body's matrix may not be built yet, but its scale is its own
+            float scale = entities.worldScale[e];
+            if (entities.isLone(e))
+            {
+                float3 s = entities.scaleFactor[e];
+                scale = fmaxf(fabsf(s.x), fmaxf(fabsf(s.y), fabsf(s.z)));
+            }
+            float reach = entities.sphereRadius[e] < 0 ? 0 : (entities.sphereCenter[e].norm() + entities.sphereRadius[e]) * scale;
+            candidates.clear();
+            treeGrid.query(start + path*0.5, path.norm()*0.5 + reach + treeReach, candidates);
+            if (candidates.empty())
+                continue;
+            if (entities.isLone(e))
+                entities.updateTransform(e);
+            float3 center;
+            float radius;
+            if (!entityWorldSphere(e, center, radius))
+            {
+                center = entities.position[e];
+                radius = 0;
+            }
+            // the sphere rides along with the body's position
+            float3 offset = center - entities.worldPosition(e);
+            float firstImpact = 2;
+            for (unsigned int i = 0; i<candidates.size(); i++)
+            {
+                bool touching;
+                float t = timeOfImpactWithMesh(treeColliders[candidates[i]], start + offset, path, radius, touching);
+                if (touching)
+                    entities.velocity[b] = entities.velocity[b]*-2;
+                else if (t >= 0 && t < firstImpact)
+                    firstImpact = t;
+            }
+            if (firstImpact <= 1)
+            {
+                float3 impact = start + path*firstImpact;
+                impact.y = std::max(impact.y, entities.groundHeight(impact.x, impact.z));
+                entities.position[e] = impact;
+                entities.transformDirty[e] = 1;
+                entities.velocity[b] = entities.velocity[b]*-2;
+            }
+        }
+    }
+    
+    void checkCollisions()
+    {
+        ProfileScope scope(profiler, "Scene::checkCollisions");
+        int hitIndex = 0;
+        // bodies' spheres are read from their world matrices. Lone bodies get theirs from the thread
+        // testing them, and only when a tree is near; bodies in a hierarchy need their parents' first.
+        if (entities.hasAttachments())
+            entities.updateTransforms();
+        
+        if (physicsPool)
+            physicsPool->parallelFor(0, entities.bodyEntity.size(), 512, [this](int begin, int end)
+                                     {
+                                         std::vector<int> candidates;
+                                         collideBodiesWithTrees(begin, end, candidates);
+                                     });
+        else
+            collideBodiesWithTrees(0, entities.bodyEntity.size(), nearby);
         
-        for (int i = 0; i<orbPositions.size(); i++)
+        // orbs are picked up anywhere along the avatar's path this tick, in order
+        avatarPos = avatar->getPosition();
+        float3 avatarStart = entities.previousPosition[entities.bodyOf[avatar->getEntity()]];
+        float3 avatarPath = avatarPos - avatarStart;
+        nearby.clear();
+        orbGrid.query(avatarStart + avatarPath*0.5, avatarPath.norm()*0.5 + 6, nearby);
+        std::sort(nearby.begin(), nearby.end());
+        for (unsigned int n = 0; n<nearby.size(); n++)
         {
-            float dist = distance(avatarPos, orbPositions[i]);
-            if (dist<6 && hitIndices[i]==0 && hitOrbs == i)
+            int i = nearby[n];
+            if (timeOfImpact(avatarStart, avatarPath, orbGrid.getPosition(i), 6) >= 0 && hitIndices[i]==0 && hitOrbs == i)
             {
                 hitOrbs++;
                 hitIndices[i] = 1;
                 hitIndex = i;
-                objects.at(treePositions.size()+i+1)->translate(float3 (0,-200,0));
+                orbs[i]->translate(float3 (0,-200,0));
+                orbGrid.move(i, orbs[i]->getPosition());
                 avatar->scale(float3(1/scaleFactor,1/scaleFactor,1/scaleFactor));
                 scaleFactor+=0.1;
                 avatar->scale(float3(scaleFactor,scaleFactor,scaleFactor));
-                objects[treePositions.size()+hitOrbs+1]->changeMaterial(new TexturedMaterial("/Users/jakevitale/Documents/Comp Sci/Computer Graphics/OpenGL/OpenGL/bullet2.png"));
+                if (hitOrbs < orbs.size())
+                    orbs[hitOrbs]->changeMaterial(selectedOrbMaterial);
                 
             }
         }
         
-        if (hitOrbs == orbPositions.size())
+        if (hitOrbs == orbs.size())
         {
             avatar->setVelocity(float3(0,30,0));
         }
@@ -887,22 +2070,205 @@ public:
     
     void control(std::vector<bool>& keysPressed)
     {
+        ProfileScope scope(profiler, "Scene::control");
         std::vector<Object*> spawn;
         for (unsigned int iObject=0;
              iObject<objects.size(); iObject++)
             objects.at(iObject)->control(keysPressed, spawn, objects);
     }
+    
+    // One simulation tick, shared by the GLUT idle callback and the headless runner
+    void step(float t, float dt, std::vector<bool>& keysPressed)
+    {
+        ProfileScope scope(profiler, "Scene::step");
+        // 'l' reloads the level, once per press
+        if (keysPressed.at('l') && !reloadHeld)
+            reload();
+        reloadHeld = keysPressed.at('l');
+        camera.move(dt, keysPressed);
+        
+        control(keysPressed);
+        move(t,dt);
+        streamWorld();
+//        setCameraEye();
+//        setCameraLookAt();
+        checkCollisions();
+    }
 };
 
 Scene scene;
 std::vector<bool> keysPressed;
 
+// -trace file.json: the profiler's buffer is written there as a Chrome trace on exit
+const char* traceFilename = 0;
+
+void writeTrace()
+{
+    if (profiler.writeTrace(traceFilename))
+        printf("trace written to %s\n", traceFilename);
+    else
+        printf("could not write trace to %s\n", traceFilename);
+}
+
+// -record file: input events, tick times and state hashes are saved there on exit
+// -replay file: ticks are taken from the file instead of the clock and the keyboard
+const char* recordFilename = 0;
+InputRecording* recording = 0;
+InputRecording* replay = 0;
+unsigned int replayTick = 0;
+int replayDivergedAt = -1;
+
+void saveRecording()
+{
+    if (recording->save(recordFilename))
+        printf("%u ticks recorded to %s\n", (unsigned int)recording->ticks.size(), recordFilename);
+    else
+        printf("could not write recording to %s\n", recordFilename);
+}
+
+// Ends a live tick: its events, times and resulting state go into the recording
+void recordTick(float t, float dt)
+{
+    if (recording)
+        recording->endTick(t, dt, entities.hashState());
+}
+
+// Replays the next recorded tick: its input first, then the step, then the state check.
+// Returns false once the recording is used up.
+bool replayNextTick()
+{
+    if (replayTick >= replay->ticks.size())
+        return false;
+    const InputRecording::Tick& tick = replay->ticks[replayTick];
+    for (unsigned int i = 0; i < tick.events.size(); i++)
+    {
+        const InputRecording::Event& event = tick.events[i];
+        if (event.type == InputRecording::keyDown || event.type == InputRecording::keyUp)
+            keysPressed.at(event.key) = event.type == InputRecording::keyDown;
+        else if (event.type == InputRecording::mouseDown)
+            scene.getCamera().startDrag(event.x, event.y);
+        else if (event.type == InputRecording::mouseUp)
+            scene.getCamera().endDrag();
+        else
+            scene.getCamera().drag(event.x, event.y);
+    }
+    scene.step(tick.t, tick.dt, keysPressed);
+    unsigned long long hash = entities.hashState();
+    if (replayDivergedAt < 0 && hash != tick.hash)
+    {
+        replayDivergedAt = replayTick;
+        printf("replay diverged at tick %u: state %016llx, recorded %016llx\n", replayTick, hash, tick.hash);
+    }
+    replayTick++;
+    return true;
+}
+
+// Shared by both builds: pulls -trace, -record, -replay, -assets, -world, -stream-radius and the
+// -terrain options out of the arguments so the rest keep their positions
+void parseSharedArguments(int& argc, char** argv)
+{
+    int kept = 1;
+    const char* replayFilename = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+            traceFilename = argv[++i];
+        else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+            recordFilename = argv[++i];
+        else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc)
+            replayFilename = argv[++i];
+        else if (strcmp(argv[i], "-assets") == 0 && i + 1 < argc)
+            assetRoot = argv[++i];
+        else if (strcmp(argv[i], "-world") == 0 && i + 1 < argc)
+            worldDirectory = argv[++i];
+        else if (strcmp(argv[i], "-stream-radius") == 0 && i + 1 < argc)
+            streamRadius = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-terrain-height") == 0 && i + 1 < argc)
+            terrainHeight = atof(argv[++i]);
+        else if (strcmp(argv[i], "-terrain-seed") == 0 && i + 1 < argc)
+            terrainSeed = atoi(argv[++i]);
+        else
+            argv[kept++] = argv[i];
+    }
+    argc = kept;
+    if (traceFilename)
+        atexit(writeTrace);
+    if (replayFilename)
+    {
+        replay = new InputRecording();
+        if (!replay->load(replayFilename))
+        {
+            printf("could not read recording %s\n", replayFilename);
+            exit(1);
+        }
+    }
+    else if (recordFilename)
+    {
+        recording = new InputRecording();
+        atexit(saveRecording);
+    }
+}
+
+// -frame-bench N: times N frames with immediate mode and N with buffer objects, then exits
+int frameBenchFrames = 0;
+int frameBenchFrame = 0;
+std::chrono::steady_clock::time_point frameBenchStart;
+
+void frameBenchmarkTick()
+{
+    if (frameBenchFrame == 0 || frameBenchFrame == frameBenchFrames)
+    {
+        if (frameBenchFrame == frameBenchFrames)
+        {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frameBenchStart).count();
+            printf("immediate mode:  %f ms/frame\n", seconds * 1000 / frameBenchFrames);
+            useBufferObjects = true;
+        }
+        else
+            useBufferObjects = false;
+        glFinish();
+        frameBenchStart = std::chrono::steady_clock::now();
+    }
+    frameBenchFrame++;
+    if (frameBenchFrame == 2 * frameBenchFrames + 1)
+    {
+        glFinish();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frameBenchStart).count();
+        printf("buffer objects:  %f ms/frame\n", seconds * 1000 / frameBenchFrames);
+        exit(0);
+    }
+}
+
+// -profile: prints each phase's p50/p99 once per second
+bool profileReport = false;
+
 void onDisplay( ) {
     glClearColor(0.1f, 0.3f, 0.8f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear screen
     
     scene.draw();
     
+    // state change counters of the last frame, shown in the title once per second
+    static int frames = 0;
+    static int lastTitleTime = 0;
+    frames++;
+    int now = glutGet(GLUT_ELAPSED_TIME);
+    if (now - lastTitleTime >= 1000)
+    {
+        char title[256];
+        sprintf(title, "OpenGL Game - %d fps, %d state changes (%d skipped), %d material changes, %d draws, %d visible (%d culled), %d shadows (%d culled) + %d cached shadow chunks, %d triangles",
+                frames * 1000 / (now - lastTitleTime), glState.changes, glState.skipped, glState.materialChanges, glState.drawSubmissions,
+                scene.visibleCount, scene.culledCount, scene.shadowVisibleCount, scene.shadowCulledCount, scene.shadowChunksDrawn(), scene.trianglesDrawn);
+        glutSetWindowTitle(title);
+        if (profileReport)
+        {
+            printf("\n");
+            profiler.report();
+        }
+        frames = 0;
+        lastTitleTime = now;
+    }
+    
     if (keysPressed.at('p'))
     {
         scene.getCamera().printCamera();
@@ -914,47 +2280,84 @@ void onDisplay( ) {
     }
     
     glutSwapBuffers(); // drawing finished
+    
+    if (frameBenchFrames > 0)
+        frameBenchmarkTick();
 }
 
 void onIdle()
 {
+    if (replay)
+    {
+        // one recorded tick per frame, then the frame time over the whole replay
+        static std::chrono::steady_clock::time_point replayStart = std::chrono::steady_clock::now();
+        if (!replayNextTick())
+        {
+            glFinish();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - replayStart).count();
+            printf("replayed %u ticks in %f s (%f ms/frame), %s\n", replayTick, seconds, seconds * 1000 / replayTick,
+                   replayDivergedAt < 0 ? "state matches" : "state DIVERGED");
+            exit(replayDivergedAt < 0 ? 0 : 1);
+        }
+        glutPostRedisplay();
+        return;
+    }
+    
     double t = glutGet(GLUT_ELAPSED_TIME) * 0.001;        	// time elapsed since starting this program in msec
     static double lastTime = 0.0;
     double dt = t - lastTime;
     lastTime = t;
     
-    scene.getCamera().move(dt, keysPressed);
-    
-    scene.control(keysPressed);
-    scene.move(t,dt);
-//    scene.setCameraEye();
-//    scene.setCameraLookAt();
-    scene.checkCollisions();
+    scene.step(t, dt, keysPressed);
+    recordTick(t, dt);
     
     glutPostRedisplay();
 }
 
+// Live input is ignored while replaying; while recording every event is logged
 void onKeyboard(unsigned char key, int x, int y)
 {
+    if (replay)
+        return;
+    if (recording)
+        recording->addEvent(InputRecording::keyDown, key);
     keysPressed.at(key) = true;
 }
 
 void onKeyboardUp(unsigned char key, int x, int y)
 {
+    if (replay)
+        return;
+    if (recording)
+        recording->addEvent(InputRecording::keyUp, key);
     keysPressed.at(key) = false;
 }
 
 void onMouse(int button, int state, int x, int y)
 {
+    if (replay)
+        return;
     if(button == GLUT_LEFT_BUTTON)
         if(state == GLUT_DOWN)
+        {
+            if (recording)
+                recording->addEvent(InputRecording::mouseDown, 0, x, y);
             scene.getCamera().startDrag(x, y);
+        }
         else
+        {
+            if (recording)
+                recording->addEvent(InputRecording::mouseUp, 0, x, y);
             scene.getCamera().endDrag();
+        }
 }
 
 void onMouseMotion(int x, int y)
 {
+    if (replay)
+        return;
+    if (recording)
+        recording->addEvent(InputRecording::mouseMotion, 0, x, y);
     scene.getCamera().drag(x, y);
 }
 
@@ -964,7 +2367,185 @@ void onReshape(int winWidth, int winHeight)
     scene.getCamera().setAspectRatio((float)winWidth/winHeight);
 }	
 
+#ifdef HEADLESS
+// Headless build (compile with -DHEADLESS): no window and no GL context.
+// Steps the scene for a fixed number of ticks as fast as possible and reports throughput.
+// usage: OpenGLGame [ticks] [tickRate] [-record file]
+//        OpenGLGame -replay file
+//        OpenGLGame --make-world dir [kilometres] [treesPerKm2]
+//        OpenGLGame --collision-bench
+//        OpenGLGame --physics-bench [bouncers] [ticks]
+// Benchmark.cpp includes this file with GAME_NO_MAIN defined to reuse the scene without this main.
+
+// Times Scene::checkCollisions against forests of 10 to 1M trees planted at constant density.
+// With the spatial hash broad-phase the cost per query should stay flat as the forest grows.
+void collisionBenchmark()
+{
+    const int queries = 100000;
+    const float areaPerTree = 60 * 60;
+    
+    for (int trees = 10; trees <= 1000000; trees *= 10)
+    {
+        srand(1);
+        Scene* forest = new Scene();
+        forest->initialize(true);
+        float side = sqrtf(trees * areaPerTree);
+        for (int i = 9; i < trees; i++)
+            forest->addTree(float3((rand() / (float)RAND_MAX - 0.5f) * side, 0, (rand() / (float)RAND_MAX - 0.5f) * side));
+        
+        Bouncer* avatar = forest->getAvatar();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int q = 0; q < queries; q++)
+        {
+            float3 target((rand() / (float)RAND_MAX - 0.5f) * side, 0, (rand() / (float)RAND_MAX - 0.5f) * side);
+            avatar->translate(target - avatar->getPosition());
+            avatar->setVelocity(float3(0,0,0));
+            forest->checkCollisions();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%8d trees: %f ns/query\n", trees, seconds * 1e9 / queries);
+        
+        delete forest;
+    }
+}
+
+// Steps a stress scene of many bouncers among trees with 1, 2, 4... threads.
+// Reports the speedup over the serial path and checks every run ends in the same state.
+void physicsBenchmark(int bouncers, int ticks)
+{
+    // hardware_concurrency() is 0 when it can not tell
+    int maxThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    double serialSeconds = 0;
+    unsigned long long serialHash = 0;
+    std::vector<bool> noKeys(256, false);
+    
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        srand(1);
+        Scene* stress = new Scene();
+        stress->initialize(true);
+        stress->setPhysicsThreads(threads);
+        float side = sqrtf(bouncers * 60.0f * 60.0f);
+        for (int i = 0; i < 1000; i++)
+            stress->addTree(float3((rand() / (float)RAND_MAX - 0.5f) * side, 0, (rand() / (float)RAND_MAX - 0.5f) * side));
+        for (int i = 0; i < bouncers; i++)
+            stress->addBouncer(float3((rand() / (float)RAND_MAX - 0.5f) * side, 5, (rand() / (float)RAND_MAX - 0.5f) * side),
+                               float3(rand() / (float)RAND_MAX - 0.5f, 0, rand() / (float)RAND_MAX - 0.5f) * 40);
+        
+        double dt = 1.0 / 60;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int tick = 0; tick < ticks; tick++)
+            stress->step(tick * dt, dt, noKeys);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        
+        unsigned long long hash = entities.hashState();
+        if (threads == 1)
+        {
+            serialSeconds = seconds;
+            serialHash = hash;
+        }
+        printf("%2d threads: %f ms/tick, speedup %.2fx, state %016llx %s\n", threads, seconds * 1000 / ticks,
+               serialSeconds / seconds, hash, hash == serialHash ? "matches serial" : "DIVERGED");
+        
+        delete stress;
+    }
+}
+
+// Writes a square forest of the given side as 128m tiles for -world, with a clearing around the
+// teapots at the origin
+void makeWorld(const char* directory, float kilometres, float treesPerKm2)
+{
+    const float chunkSize = 128;
+    int half = (int)ceilf(kilometres * 1000 / chunkSize / 2);
+    srand(1);
+    int total = 0;
+    for (int x = -half; x < half; x++)
+        for (int z = -half; z < half; z++)
+        {
+            std::vector<WorldProp> props;
+            int count = (int)(treesPerKm2 * chunkSize * chunkSize * 1e-6f);
+            for (int i = 0; i < count; i++)
+            {
+                WorldProp prop;
+                prop.type = WorldProp::tree;
+                prop.position = float3((x + rand() / (float)RAND_MAX) * chunkSize, 0, (z + rand() / (float)RAND_MAX) * chunkSize);
+                prop.scale = 0.4f + 0.2f * rand() / (float)RAND_MAX;
+                prop.angle = 360.0f * rand() / (float)RAND_MAX;
+                if (prop.position.norm() > 120)
+                    props.push_back(prop);
+            }
+            if (!WorldStreamer::writeChunk(directory, x, z, props))
+            {
+                printf("could not write to %s\n", directory);
+                return;
+            }
+            total += props.size();
+        }
+    WorldStreamer::writeManifest(directory, chunkSize, -half, -half, half - 1, half - 1);
+    printf("%d trees in %d tiles written to %s\n", total, 4 * half * half, directory);
+}
+
+#ifndef GAME_NO_MAIN
+int main(int argc, char **argv) {
+    parseSharedArguments(argc, argv);
+    // a tick here is well under a microsecond, so the clock reads would show; only profile when tracing
+    profiler.enabled = traceFilename != 0;
+    if (argc > 2 && strcmp(argv[1], "--make-world") == 0)
+    {
+        makeWorld(argv[2], argc > 3 ? atof(argv[3]) : 4, argc > 4 ? atof(argv[4]) : 400);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--collision-bench") == 0)
+    {
+        collisionBenchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--physics-bench") == 0)
+    {
+        physicsBenchmark(argc > 2 ? atoi(argv[2]) : 10000, argc > 3 ? atoi(argv[3]) : 600);
+        return 0;
+    }
+    
+    int ticks = 100000;
+    double tickRate = 60.0;
+    if (argc > 1) ticks = atoi(argv[1]);
+    if (argc > 2) tickRate = atof(argv[2]);
+    double dt = 1.0 / tickRate;
+    
+    scene.initialize(true);
+    for(int i=0; i<256; i++)
+        keysPressed.push_back(false);
+    
+    if (replay)
+    {
+        // the recorded ticks as fast as possible; stops at the first divergence
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (replayDivergedAt < 0 && replayNextTick())
+            ;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("replayed %u of %u ticks in %f s (%f us/tick), %s\n", replayTick, (unsigned int)replay->ticks.size(), seconds,
+               seconds * 1e6 / replayTick, replayDivergedAt < 0 ? "state matches" : "state DIVERGED");
+        return replayDivergedAt < 0 ? 0 : 1;
+    }
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < ticks; tick++)
+    {
+        scene.step(tick * dt, dt, keysPressed);
+        recordTick(tick * dt, dt);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    printf("%d ticks in %f s (%f ticks/s, %f us/tick)\n", ticks, seconds, ticks / seconds, seconds * 1e6 / ticks);
+    if (profiler.enabled)
+        profiler.report();
+    
+    return 0;
+}
+#endif // GAME_NO_MAIN
+#else
 int main(int argc, char **argv) {
+    parseSharedArguments(argc, argv);
     glutInit(&argc, argv);						// initialize GLUT
     glutInitWindowSize(600, 600);				// startup window size 
     glutInitWindowPosition(100, 100);           // where to put window on screen
@@ -986,6 +2567,31 @@ int main(int argc, char **argv) {
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_NORMALIZE);
     
+    // buffer objects are core since OpenGL 1.5; -immediate forces the old path
+    int glMajor = 1, glMinor = 0;
+    sscanf((const char*)glGetString(GL_VERSION), "%d.%d", &glMajor, &glMinor);
+    useBufferObjects = glMajor > 1 || glMinor >= 5;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-immediate") == 0)
+            useBufferObjects = false;
+        if (strcmp(argv[i], "-no-instancing") == 0)
+            useInstancing = false;
+        if (strcmp(argv[i], "-frame-bench") == 0 && i + 1 < argc)
+            frameBenchFrames = atoi(argv[++i]);
+        if (strcmp(argv[i], "-no-shadow-cache") == 0)
+            useShadowCache = false;
+        if (strcmp(argv[i], "-triangle-budget") == 0 && i + 1 < argc)
+            scene.triangleBudget = atoi(argv[++i]);
+        if (strcmp(argv[i], "-lod-error") == 0 && i + 1 < argc)
+            scene.lodPixelError = atof(argv[++i]);
+        if (strcmp(argv[i], "-profile") == 0)
+            profileReport = true;
+        if (strcmp(argv[i], "-no-profiler") == 0)
+            profiler.enabled = false;
+    }
+    loadImmediateMeshes = !useBufferObjects || frameBenchFrames > 0;
+    
     scene.initialize();
     for(int i=0; i<256; i++)
         keysPressed.push_back(false);
@@ -994,3 +2600,4 @@ int main(int argc, char **argv) {
     
     return 0;
 }
+#endif // HEADLESS
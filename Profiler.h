@@ -0,0 +1,189 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+//Scoped timings of the frame phases, recorded into a fixed ring buffer of the most recent events.
+//Recording is one atomic increment plus the clock reads, from any thread and without locks, so it
+//can stay on all the time. Each slot carries a sequence number, written last, which lets readers
+//skip slots that are being overwritten while they look. Event names must be string literals, only
+//the pointers are stored.
+class Profiler
+{
+public:
+    struct Summary
+    {
+        int count;
+        double p50;         // milliseconds
+        double p99;
+        double max;
+    };
+
+private:
+    struct Event
+    {
+        std::atomic<uint64_t> sequence;    // index + 1 once written, 0 while being written
+        std::atomic<const char*> name;
+        std::atomic<int64_t> start;         // nanoseconds since the profiler was created
+        std::atomic<int64_t> duration;
+        std::atomic<int> thread;
+    };
+
+    struct Copy
+    {
+        const char* name;
+        int64_t start;
+        int64_t duration;
+        int thread;
+    };
+
+    static const unsigned int capacity = 1 << 16;
+
+    std::vector<Event> events;
+    std::atomic<uint64_t> head;
+    std::chrono::steady_clock::time_point origin;
+
+    //Copies event index out of its slot; false if it was overwritten or is still being written
+    bool read(uint64_t index, Copy& copy)
+    {
+        Event& event = events[index & (capacity - 1)];
+        uint64_t before = event.sequence.load(std::memory_order_acquire);
+        copy.name = event.name.load(std::memory_order_relaxed);
+        copy.start = event.start.load(std::memory_order_relaxed);
+        copy.duration = event.duration.load(std::memory_order_relaxed);
+        copy.thread = event.thread.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = event.sequence.load(std::memory_order_relaxed);
+        return before == index + 1 && after == before;
+    }
+
+    uint64_t oldest(uint64_t newest)
+    {
+        return newest > capacity ? newest - capacity : 0;
+    }
+
+public:
+    bool enabled;
+
+    Profiler():events(capacity),head(0),enabled(true)
+    {
+        origin = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < capacity; i++)
+            events[i].sequence.store(0, std::memory_order_relaxed);
+    }
+
+    int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    //Small ids in the order threads first record something, for the trace's thread rows
+    static int threadIndex()
+    {
+        static std::atomic<int> next(0);
+        thread_local int index = next++;
+        return index;
+    }
+
+    void record(const char* name, int64_t start, int64_t end)
+    {
+        uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+        Event& event = events[index & (capacity - 1)];
+        event.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        event.name.store(name, std::memory_order_relaxed);
+        event.start.store(start, std::memory_order_relaxed);
+        event.duration.store(end - start, std::memory_order_relaxed);
+        event.thread.store(threadIndex(), std::memory_order_relaxed);
+        event.sequence.store(index + 1, std::memory_order_release);
+    }
+
+    //Percentiles over the last window events of the named phase still in the buffer
+    Summary summarize(const char* name, unsigned int window = 256)
+    {
+        std::vector<double> durations;
+        uint64_t newest = head.load(std::memory_order_acquire);
+        uint64_t first = oldest(newest);
+        Copy copy;
+        for (uint64_t i = newest; i > first && durations.size() < window; i--)
+            if (read(i - 1, copy) && strcmp(copy.name, name) == 0)
+                durations.push_back(copy.duration * 1e-6);
+
+        Summary summary;
+        summary.count = durations.size();
+        summary.p50 = summary.p99 = summary.max = 0;
+        if (durations.empty())
+            return summary;
+        std::sort(durations.begin(), durations.end());
+        summary.p50 = durations[(durations.size() - 1) / 2];
+        summary.p99 = durations[(durations.size() - 1) * 99 / 100];
+        summary.max = durations.back();
+        return summary;
+    }
+
+    //One line per phase found in the buffer
+    void report(FILE* file = stdout, unsigned int window = 256)
+    {
+        std::map<std::string, bool> names;
+        uint64_t newest = head.load(std::memory_order_acquire);
+        Copy copy;
+        for (uint64_t i = oldest(newest); i < newest; i++)
+            if (read(i, copy))
+                names[copy.name] = true;
+        for (std::map<std::string, bool>::iterator iName = names.begin(); iName != names.end(); ++iName)
+        {
+            Summary summary = summarize(iName->first.c_str(), window);
+            fprintf(file, "%-28s p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms  (%d samples)\n",
+                    iName->first.c_str(), summary.p50, summary.p99, summary.max, summary.count);
+        }
+    }
+
+    //Everything still in the buffer as Chrome trace_event JSON, for chrome://tracing or Perfetto
+    bool writeTrace(const char* filename)
+    {
+        FILE* file = fopen(filename, "w");
+        if (!file)
+            return false;
+        fprintf(file, "{\"traceEvents\":[\n");
+        uint64_t newest = head.load(std::memory_order_acquire);
+        bool first = true;
+        Copy copy;
+        for (uint64_t i = oldest(newest); i < newest; i++)
+        {
+            if (!read(i, copy))
+                continue;
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"game\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+                    first ? "" : ",\n", copy.name, copy.start * 1e-3, copy.duration * 1e-3, copy.thread);
+            first = false;
+        }
+        fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        return fclose(file) == 0;
+    }
+};
+
+//Times the enclosing block
+class ProfileScope
+{
+    Profiler& profiler;
+    const char* name;
+    int64_t start;
+
+public:
+    ProfileScope(Profiler& profiler, const char* name):profiler(profiler),name(name)
+    {
+        start = profiler.enabled ? profiler.now() : -1;
+    }
+
+    ~ProfileScope()
+    {
+        if (start >= 0)
+            profiler.record(name, start, profiler.now());
+    }
+};
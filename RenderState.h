@@ -0,0 +1,197 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <OpenGL/gl.h>
+
+//Shadow copy of the fixed-function state the game touches, so setting a state that is already
+//current costs nothing. Everything drawn through the scene must change these states through the
+//cache; reset() forgets the copy at the start of each frame in case anything else touched GL.
+class GLStateCache
+{
+    struct Capability
+    {
+        GLenum cap;
+        bool enabled;
+    };
+
+    std::vector<Capability> capabilities;
+    bool textureKnown;
+    GLuint boundTexture;
+    GLenum blendSource;
+    GLenum blendDestination;
+    GLint textureEnvMode;
+    const void* material;
+
+    void setCapability(GLenum cap, bool enabled)
+    {
+        for (unsigned int i = 0; i < capabilities.size(); i++)
+            if (capabilities[i].cap == cap)
+            {
+                if (capabilities[i].enabled == enabled)
+                {
+                    skipped++;
+                    return;
+                }
+                capabilities[i].enabled = enabled;
+                issue(cap, enabled);
+                return;
+            }
+        Capability c;
+        c.cap = cap;
+        c.enabled = enabled;
+        capabilities.push_back(c);
+        issue(cap, enabled);
+    }
+
+    void issue(GLenum cap, bool enabled)
+    {
+        if (enabled)
+            glEnable(cap);
+        else
+            glDisable(cap);
+        changes++;
+    }
+
+public:
+    //per-frame counters
+    int changes;            // state changes sent to GL
+    int skipped;            // redundant changes filtered out
+    int materialChanges;    // Material::apply calls that were actually needed
+    int drawSubmissions;    // draw queue items submitted
+
+    GLStateCache()
+    {
+        reset();
+        resetCounters();
+    }
+
+    void reset()
+    {
+        capabilities.clear();
+        textureKnown = false;
+        boundTexture = 0;
+        blendSource = blendDestination = 0;
+        textureEnvMode = -1;
+        material = 0;
+    }
+
+    void resetCounters()
+    {
+        changes = skipped = materialChanges = drawSubmissions = 0;
+    }
+
+    void enable(GLenum cap)
+    {
+        setCapability(cap, true);
+    }
+
+    void disable(GLenum cap)
+    {
+        setCapability(cap, false);
+    }
+
+    void bindTexture(GLuint texture)
+    {
+        if (textureKnown && boundTexture == texture)
+        {
+            skipped++;
+            return;
+        }
+        textureKnown = true;
+        boundTexture = texture;
+        glBindTexture(GL_TEXTURE_2D, texture);
+        changes++;
+    }
+
+    //Texture created or deleted behind the cache's back
+    void forgetTexture()
+    {
+        textureKnown = false;
+    }
+
+    void blendFunc(GLenum source, GLenum destination)
+    {
+        if (blendSource == source && blendDestination == destination)
+        {
+            skipped++;
+            return;
+        }
+        blendSource = source;
+        blendDestination = destination;
+        glBlendFunc(source, destination);
+        changes++;
+    }
+
+    void texEnvMode(GLint mode)
+    {
+        if (textureEnvMode == mode)
+        {
+            skipped++;
+            return;
+        }
+        textureEnvMode = mode;
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, mode);
+        changes++;
+    }
+
+    //Returns true when m differs from the material applied last, i.e. its state must be sent
+    bool useMaterial(const void* m)
+    {
+        if (material == m)
+        {
+            skipped++;
+            return false;
+        }
+        material = m;
+        materialChanges++;
+        return true;
+    }
+};
+
+//Draws collected for one pass, sorted so that items sharing a texture, material and mesh are
+//submitted back to back and the state cache can skip the redundant changes between them
+template <typename Payload>
+class RenderQueue
+{
+public:
+    struct Item
+    {
+        GLuint texture;
+        const void* material;
+        const void* mesh;
+        Payload payload;
+
+        bool operator<(const Item& other) const
+        {
+            if (texture != other.texture)
+                return texture < other.texture;
+            if (material != other.material)
+                return material < other.material;
+            return mesh < other.mesh;
+        }
+    };
+
+    std::vector<Item> items;
+
+    void clear()
+    {
+        items.clear();
+    }
+
+    void push(GLuint texture, const void* material, const void* mesh, Payload payload)
+    {
+        Item item;
+        item.texture = texture;
+        item.material = material;
+        item.mesh = mesh;
+        item.payload = payload;
+        items.push_back(item);
+    }
+
+    //Stable, so items with equal keys keep their submission order
+    void sort()
+    {
+        std::stable_sort(items.begin(), items.end());
+    }
+};
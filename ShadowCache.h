@@ -0,0 +1,223 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <utility>
+#include <math.h>
+#include <OpenGL/gl.h>
+
+#include "float3.h"
+#include "Frustum.h"
+
+//Flattened shadows of static objects, projected once into world space and kept in one set of
+//buffers. The light and the static scenery do not move, so the owner only refills the cache when
+//either changes; drawing it is a few glDrawElements calls however many objects it holds.
+//Shadow meshes stay indexed, and are binned by object into square ground chunks that are culled
+//against the view frustum. Every chunk holds a few levels of detail and draws the coarsest whose
+//error stays under the pixel limit at the chunk's distance, like MeshGeometry::selectLod.
+class ShadowCache
+{
+public:
+    static const int levelCount = 4;
+
+private:
+    struct Chunk
+    {
+        float3 min;
+        float3 max;
+        unsigned int first[levelCount];     // index ranges in the buffer
+        unsigned int count[levelCount];
+        float error[levelCount];            // world space, the worst of the chunk's objects
+    };
+
+    struct Bin
+    {
+        std::vector<float> vertices[levelCount];
+        std::vector<unsigned int> indices[levelCount];
+        float error[levelCount];
+        Bin()
+        {
+            for (int level = 0; level < levelCount; level++)
+                error[level] = 0;
+        }
+    };
+
+    float chunkSize;
+    std::map<std::pair<int, int>, Bin> bins;
+    std::vector<float> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<Chunk> chunks;
+    GLuint vertexBuffer;
+    GLuint indexBuffer;
+    bool uploaded;
+
+public:
+    //per-frame counters
+    int chunksDrawn;
+    int drawCalls;
+
+    ShadowCache(float chunkSize = 64):chunkSize(chunkSize),vertexBuffer(0),indexBuffer(0),uploaded(false),chunksDrawn(0),drawCalls(0){}
+
+    ~ShadowCache()
+    {
+        if (vertexBuffer)
+        {
+            glDeleteBuffers(1, &vertexBuffer);
+            glDeleteBuffers(1, &indexBuffer);
+        }
+    }
+
+    void clear()
+    {
+        bins.clear();
+        vertices.clear();
+        indices.clear();
+        chunks.clear();
+        uploaded = false;
+    }
+
+    //One level of one object's shadow: world space points and triangles indexing them, binned by
+    //the object's center. Every object should be added at every level, finest first.
+    void addMesh(const std::vector<float3>& points, const std::vector<unsigned int>& triangles, float3 center, int level, float error)
+    {
+        std::pair<int, int> key((int)floorf(center.x / chunkSize), (int)floorf(center.z / chunkSize));
+        Bin& bin = bins[key];
+        std::vector<float>& binVertices = bin.vertices[level];
+        std::vector<unsigned int>& binIndices = bin.indices[level];
+        unsigned int base = binVertices.size() / 3;
+        for (unsigned int i = 0; i < points.size(); i++)
+        {
+            binVertices.push_back(points[i].x);
+            binVertices.push_back(points[i].y);
+            binVertices.push_back(points[i].z);
+        }
+        for (unsigned int i = 0; i < triangles.size(); i++)
+            binIndices.push_back(base + triangles[i]);
+        bin.error[level] = fmaxf(bin.error[level], error);
+    }
+
+    //Lays the bins out level after level, chunk after chunk within a level, so neighbouring chunks
+    //drawn at the same level are one range; the buffers are uploaded on the next draw
+    void finish()
+    {
+        vertices.clear();
+        indices.clear();
+        chunks.clear();
+        for (std::map<std::pair<int, int>, Bin>::iterator iBin = bins.begin(); iBin != bins.end(); ++iBin)
+        {
+            Bin& bin = iBin->second;
+            if (bin.vertices[0].empty())
+                continue;
+            Chunk chunk;
+            chunk.min = chunk.max = float3(bin.vertices[0][0], bin.vertices[0][1], bin.vertices[0][2]);
+            for (unsigned int i = 0; i < bin.vertices[0].size(); i += 3)
+            {
+                const float* p = &bin.vertices[0][i];
+                chunk.min = float3(fminf(chunk.min.x, p[0]), fminf(chunk.min.y, p[1]), fminf(chunk.min.z, p[2]));
+                chunk.max = float3(fmaxf(chunk.max.x, p[0]), fmaxf(chunk.max.y, p[1]), fmaxf(chunk.max.z, p[2]));
+            }
+            chunks.push_back(chunk);
+        }
+        for (int level = 0; level < levelCount; level++)
+        {
+            unsigned int c = 0;
+            for (std::map<std::pair<int, int>, Bin>::iterator iBin = bins.begin(); iBin != bins.end(); ++iBin)
+            {
+                Bin& bin = iBin->second;
+                if (bin.vertices[0].empty())
+                    continue;
+                Chunk& chunk = chunks[c++];
+                chunk.first[level] = indices.size();
+                chunk.count[level] = bin.indices[level].size();
+                chunk.error[level] = bin.error[level];
+                unsigned int base = vertices.size() / 3;
+                for (unsigned int i = 0; i < bin.indices[level].size(); i++)
+                    indices.push_back(base + bin.indices[level][i]);
+                vertices.insert(vertices.end(), bin.vertices[level].begin(), bin.vertices[level].end());
+            }
+        }
+        bins.clear();
+        uploaded = false;
+    }
+
+    //Triangles of the finest level
+    int triangleCount()
+    {
+        int count = 0;
+        for (unsigned int i = 0; i < chunks.size(); i++)
+            count += chunks[i].count[0];
+        return count / 3;
+    }
+
+    //Draws the chunks in view, merging neighbouring ranges into one call; shadow color and state
+    //must already be set. From client memory when buffer objects are off.
+    void draw(const Frustum& frustum, float3 eye, float pixelsPerUnit, float maxPixels, bool bufferObjects)
+    {
+        chunksDrawn = drawCalls = 0;
+        if (chunks.empty())
+            return;
+        const unsigned int* indexBase = indices.data();
+        if (bufferObjects)
+        {
+            if (!vertexBuffer)
+            {
+                glGenBuffers(1, &vertexBuffer);
+                glGenBuffers(1, &indexBuffer);
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+            if (!uploaded)
+            {
+                glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+                uploaded = true;
+            }
+            glVertexPointer(3, GL_FLOAT, 0, (void*)0);
+            indexBase = 0;
+        }
+        else
+            glVertexPointer(3, GL_FLOAT, 0, vertices.data());
+        glEnableClientState(GL_VERTEX_ARRAY);
+
+        unsigned int first = 0;
+        unsigned int count = 0;
+        for (unsigned int i = 0; i < chunks.size(); i++)
+        {
+            if (frustum.classifyBox(chunks[i].min, chunks[i].max) == Frustum::outside)
+                continue;
+            chunksDrawn++;
+            const Chunk& chunk = chunks[i];
+            float3 nearest(fminf(fmaxf(eye.x, chunk.min.x), chunk.max.x),
+                           fminf(fmaxf(eye.y, chunk.min.y), chunk.max.y),
+                           fminf(fmaxf(eye.z, chunk.min.z), chunk.max.z));
+            float distance = (nearest - eye).norm();
+            int level = 0;
+            while (level + 1 < levelCount && chunk.error[level + 1] * pixelsPerUnit <= maxPixels * distance)
+                level++;
+            if (count > 0 && first + count == chunk.first[level])
+            {
+                count += chunk.count[level];
+                continue;
+            }
+            if (count > 0)
+            {
+                glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, indexBase + first);
+                drawCalls++;
+            }
+            first = chunk.first[level];
+            count = chunk.count[level];
+        }
+        if (count > 0)
+        {
+            glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, indexBase + first);
+            drawCalls++;
+        }
+
+        glDisableClientState(GL_VERTEX_ARRAY);
+        if (bufferObjects)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        }
+    }
+};
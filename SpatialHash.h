@@ -0,0 +1,153 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <math.h>
+
+#include "float3.h"
+
+//Uniform grid over the ground (x,z) plane, stored sparsely in a hash map.
+//Items are points identified by an integer id; queries return every id within a radius,
+//touching only the cells that overlap the query circle. Ids of removed items are handed out again.
+class SpatialHash
+{
+    struct Item
+    {
+        float3 position;
+        long long cell;
+        bool active;
+    };
+
+    float cellSize;
+    std::unordered_map<long long, std::vector<int> > cells;
+    std::vector<Item> items;
+    std::vector<int> freeIds;
+
+    int cellCoord(float v)
+    {
+        return (int)floorf(v / cellSize);
+    }
+
+    //Both coordinates packed into one key; shifted as unsigned, since shifting a negative x is undefined
+    static long long cellKey(int x, int z)
+    {
+        return (long long)(((unsigned long long)(unsigned int)x << 32) | (unsigned int)z);
+    }
+
+    void addToCell(long long key, int id)
+    {
+        cells[key].push_back(id);
+    }
+
+    void removeFromCell(long long key, int id)
+    {
+        std::unordered_map<long long, std::vector<int> >::iterator c = cells.find(key);
+        if (c == cells.end())
+            return;
+        std::vector<int>& ids = c->second;
+        for (unsigned int i = 0; i<ids.size(); i++)
+            if (ids[i] == id)
+            {
+                ids[i] = ids.back();
+                ids.pop_back();
+                break;
+            }
+        if (ids.empty())
+            cells.erase(c);
+    }
+
+public:
+    SpatialHash(float cellSize = 16):cellSize(cellSize){}
+
+    //Registers a point and returns its id
+    int insert(float3 position)
+    {
+        Item item;
+        item.position = position;
+        item.cell = cellKey(cellCoord(position.x), cellCoord(position.z));
+        item.active = true;
+        int id;
+        if (!freeIds.empty())
+        {
+            id = freeIds.back();
+            freeIds.pop_back();
+            items[id] = item;
+        }
+        else
+        {
+            items.push_back(item);
+            id = items.size()-1;
+        }
+        addToCell(item.cell, id);
+        return id;
+    }
+
+    //Moves an item, only touching the cell lists when it crosses a cell border
+    void move(int id, float3 position)
+    {
+        Item& item = items.at(id);
+        item.position = position;
+        if (!item.active)
+            return;
+        long long key = cellKey(cellCoord(position.x), cellCoord(position.z));
+        if (key == item.cell)
+            return;
+        removeFromCell(item.cell, id);
+        item.cell = key;
+        addToCell(key, id);
+    }
+
+    void remove(int id)
+    {
+        Item& item = items.at(id);
+        if (!item.active)
+            return;
+        removeFromCell(item.cell, id);
+        item.active = false;
+        freeIds.push_back(id);
+    }
+
+    float3 getPosition(int id)
+    {
+        return items.at(id).position;
+    }
+
+    //Appends the ids of all items within radius of center (measured in the x,z plane)
+    void query(float3 center, float radius, std::vector<int>& result)
+    {
+        int minX = cellCoord(center.x - radius);
+        int maxX = cellCoord(center.x + radius);
+        int minZ = cellCoord(center.z - radius);
+        int maxZ = cellCoord(center.z + radius);
+        float radius2 = radius * radius;
+
+        for (int x = minX; x<=maxX; x++)
+            for (int z = minZ; z<=maxZ; z++)
+            {
+                std::unordered_map<long long, std::vector<int> >::iterator c = cells.find(cellKey(x, z));
+                if (c == cells.end())
+                    continue;
+                std::vector<int>& ids = c->second;
+                for (unsigned int i = 0; i<ids.size(); i++)
+                {
+                    float3 p = items[ids[i]].position;
+                    float dx = p.x - center.x;
+                    float dz = p.z - center.z;
+                    if (dx*dx + dz*dz <= radius2)
+                        result.push_back(ids[i]);
+                }
+            }
+    }
+
+    void clear()
+    {
+        cells.clear();
+        items.clear();
+        freeIds.clear();
+    }
+
+    int size()
+    {
+        return items.size();
+    }
+};
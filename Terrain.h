@@ -0,0 +1,289 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <math.h>
+#include <OpenGL/gl.h>
+
+#include "float3.h"
+#include "Frustum.h"
+#include "Heightfield.h"
+
+//Draws a Heightfield as square chunks with geomipmapping: every chunk has levels that skip every
+//2nd, 4th, ... sample, and draws the coarsest whose error stays under the pixel limit at the
+//chunk's distance, like MeshGeometry::selectLod. All chunks share one index buffer per level, only
+//the vertices are per chunk. Chunks are made when they first come within range of the eye and
+//dropped again once they are well out of it, so memory follows the view distance and not the size
+//of the field, which has no edge. Skirts hanging off the chunk edges hide the cracks between chunks
+//at different levels.
+class Terrain
+{
+public:
+    static const int chunkQuads = 32;
+    static const int levelCount = 6;        // steps 1, 2, 4, ... chunkQuads
+
+private:
+    static const int gridVertices = (chunkQuads + 1) * (chunkQuads + 1);
+    static const int vertexCount = gridVertices + 4 * (chunkQuads + 1);
+
+    struct Chunk
+    {
+        float3 min;
+        float3 max;
+        float error[levelCount];            // largest height difference to the full grid
+        std::vector<float> vertices;        // position and normal
+        GLuint buffer;
+    };
+
+    const Heightfield& field;
+    std::unordered_map<long long, Chunk> chunks;      // by chunkKey()
+    std::vector<unsigned short> indices;
+    unsigned int first[levelCount];
+    unsigned int count[levelCount];
+    GLuint indexBuffer;
+    bool indexUploaded;
+
+    static long long chunkKey(int chunkX, int chunkZ)
+    {
+        return (long long)(((unsigned long long)(unsigned int)chunkX << 32) | (unsigned int)chunkZ);
+    }
+
+    float3 gridPoint(int chunkX, int chunkZ, int i, int j)
+    {
+        int si = chunkX * chunkQuads + i;
+        int sj = chunkZ * chunkQuads + j;
+        return float3(si * field.getSpacing(), field.sample(si, sj), sj * field.getSpacing());
+    }
+
+    //Index lists of every level, skirts included, one after the other
+    void buildIndices()
+    {
+        for (int level = 0; level < levelCount; level++)
+        {
+            int step = 1 << level;
+            first[level] = indices.size();
+            for (int j = 0; j < chunkQuads; j += step)
+                for (int i = 0; i < chunkQuads; i += step)
+                {
+                    unsigned short a = j * (chunkQuads + 1) + i;
+                    unsigned short b = a + step;
+                    unsigned short c = a + step * (chunkQuads + 1);
+                    unsigned short d = c + step;
+                    unsigned short quad[6] = {a, d, b, a, c, d};
+                    indices.insert(indices.end(), quad, quad + 6);
+                }
+            // edges in the order the skirt vertices are stored: z = 0, z = max, x = 0, x = max
+            for (int edge = 0; edge < 4; edge++)
+                for (int k = 0; k < chunkQuads; k += step)
+                {
+                    unsigned short top[2];
+                    for (int n = 0; n < 2; n++)
+                    {
+                        int along = k + n * step;
+                        int i = edge < 2 ? along : (edge == 2 ? 0 : chunkQuads);
+                        int j = edge < 2 ? (edge == 0 ? 0 : chunkQuads) : along;
+                        top[n] = j * (chunkQuads + 1) + i;
+                    }
+                    unsigned short bottom0 = gridVertices + edge * (chunkQuads + 1) + k;
+                    unsigned short bottom1 = bottom0 + step;
+                    unsigned short quad[6] = {top[0], bottom0, top[1], top[1], bottom0, bottom1};
+                    indices.insert(indices.end(), quad, quad + 6);
+                }
+            count[level] = indices.size() - first[level];
+        }
+    }
+
+    //Bounds, vertices and level errors of a chunk; the buffer is filled on the next draw
+    Chunk& build(int chunkX, int chunkZ)
+    {
+        Chunk& chunk = chunks[chunkKey(chunkX, chunkZ)];
+        chunk.min = gridPoint(chunkX, chunkZ, 0, 0);
+        chunk.max = gridPoint(chunkX, chunkZ, chunkQuads, chunkQuads);
+        chunk.min.y = chunk.max.y = chunk.min.y;
+        for (int j = 0; j <= chunkQuads; j++)
+            for (int i = 0; i <= chunkQuads; i++)
+            {
+                float h = gridPoint(chunkX, chunkZ, i, j).y;
+                chunk.min.y = fminf(chunk.min.y, h);
+                chunk.max.y = fmaxf(chunk.max.y, h);
+            }
+        chunk.buffer = 0;
+        for (int level = 0; level < levelCount; level++)
+        {
+            // heights the level interpolates across its cells against the samples it skips
+            int step = 1 << level;
+            float error = level > 0 ? chunk.error[level - 1] : 0;
+            for (int j = 0; j <= chunkQuads; j++)
+                for (int i = 0; i <= chunkQuads; i++)
+                {
+                    int i0 = i / step * step;
+                    int j0 = j / step * step;
+                    int i1 = i0 < chunkQuads ? i0 + step : i0;
+                    int j1 = j0 < chunkQuads ? j0 + step : j0;
+                    float u = i1 > i0 ? (i - i0) / (float)step : 0;
+                    float v = j1 > j0 ? (j - j0) / (float)step : 0;
+                    float a = gridPoint(chunkX, chunkZ, i0, j0).y;
+                    float b = gridPoint(chunkX, chunkZ, i1, j0).y;
+                    float c = gridPoint(chunkX, chunkZ, i0, j1).y;
+                    float d = gridPoint(chunkX, chunkZ, i1, j1).y;
+                    float h = u >= v ? a + (b - a) * u + (d - b) * v : a + (c - a) * v + (d - c) * u;
+                    error = fmaxf(error, fabsf(h - gridPoint(chunkX, chunkZ, i, j).y));
+                }
+            chunk.error[level] = error;
+        }
+
+        float skirt = chunk.error[levelCount - 1] + field.getSpacing();
+        chunk.vertices.resize(vertexCount * 6);
+        float* out = &chunk.vertices[0];
+        for (int v = 0; v < vertexCount; v++)
+        {
+            int i, j;
+            float drop = 0;
+            if (v < gridVertices)
+            {
+                i = v % (chunkQuads + 1);
+                j = v / (chunkQuads + 1);
+            }
+            else
+            {
+                int edge = (v - gridVertices) / (chunkQuads + 1);
+                int along = (v - gridVertices) % (chunkQuads + 1);
+                i = edge < 2 ? along : (edge == 2 ? 0 : chunkQuads);
+                j = edge < 2 ? (edge == 0 ? 0 : chunkQuads) : along;
+                drop = skirt;
+            }
+            float3 p = gridPoint(chunkX, chunkZ, i, j);
+            float3 n = field.normal(chunkX * chunkQuads + i, chunkZ * chunkQuads + j);
+            out[0] = p.x; out[1] = p.y - drop; out[2] = p.z;
+            out[3] = n.x; out[4] = n.y; out[5] = n.z;
+            out += 6;
+        }
+        chunk.min.y -= skirt;
+        return chunk;
+    }
+
+    void release(Chunk& chunk)
+    {
+        if (chunk.buffer)
+            glDeleteBuffers(1, &chunk.buffer);
+        chunk.buffer = 0;
+    }
+
+public:
+    //per-frame counters
+    int chunksDrawn;
+    int trianglesDrawn;
+
+    Terrain(const Heightfield& field):field(field),indexBuffer(0),indexUploaded(false),chunksDrawn(0),trianglesDrawn(0)
+    {
+        buildIndices();
+    }
+
+    ~Terrain()
+    {
+        for (std::unordered_map<long long, Chunk>::iterator iChunk = chunks.begin(); iChunk != chunks.end(); ++iChunk)
+            release(iChunk->second);
+        if (indexBuffer)
+            glDeleteBuffers(1, &indexBuffer);
+    }
+
+    int residentCount()
+    {
+        return chunks.size();
+    }
+
+    //Draws the chunks in view within range of the eye with the current material and state, and
+    //drops the vertices of chunks that are more than a chunk beyond range. From client memory when
+    //buffer objects are off.
+    void draw(const Frustum& frustum, float3 eye, float range, float pixelsPerUnit, float maxPixels, bool bufferObjects)
+    {
+        chunksDrawn = trianglesDrawn = 0;
+        float chunkSize = chunkQuads * field.getSpacing();
+        int minX = (int)floorf((eye.x - range) / chunkSize);
+        int maxX = (int)floorf((eye.x + range) / chunkSize);
+        int minZ = (int)floorf((eye.z - range) / chunkSize);
+        int maxZ = (int)floorf((eye.z + range) / chunkSize);
+
+        const unsigned short* indexBase = indices.data();
+        if (bufferObjects)
+        {
+            if (!indexBuffer)
+                glGenBuffers(1, &indexBuffer);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+            if (!indexUploaded)
+            {
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), indices.data(), GL_STATIC_DRAW);
+                indexUploaded = true;
+            }
+            indexBase = 0;
+        }
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_NORMAL_ARRAY);
+
+        for (int chunkZ = minZ; chunkZ <= maxZ; chunkZ++)
+            for (int chunkX = minX; chunkX <= maxX; chunkX++)
+            {
+                // heights are only known once a chunk is made, so chunks are made within range
+                // across the ground plane and culled once their bounds are known
+                float dx = fmaxf(fmaxf(chunkX * chunkSize - eye.x, eye.x - (chunkX + 1) * chunkSize), 0);
+                float dz = fmaxf(fmaxf(chunkZ * chunkSize - eye.z, eye.z - (chunkZ + 1) * chunkSize), 0);
+                if (dx * dx + dz * dz > range * range)
+                    continue;
+                std::unordered_map<long long, Chunk>::iterator iChunk = chunks.find(chunkKey(chunkX, chunkZ));
+                Chunk& chunk = iChunk != chunks.end() ? iChunk->second : build(chunkX, chunkZ);
+                if (frustum.classifyBox(chunk.min, chunk.max) == Frustum::outside)
+                    continue;
+                float3 nearest(fminf(fmaxf(eye.x, chunk.min.x), chunk.max.x),
+                               fminf(fmaxf(eye.y, chunk.min.y), chunk.max.y),
+                               fminf(fmaxf(eye.z, chunk.min.z), chunk.max.z));
+                float distance = (nearest - eye).norm();
+                if (distance > range)
+                    continue;
+                int level = 0;
+                while (level + 1 < levelCount && chunk.error[level + 1] * pixelsPerUnit <= maxPixels * distance)
+                    level++;
+
+                const float* vertices = chunk.vertices.data();
+                if (bufferObjects)
+                {
+                    if (!chunk.buffer)
+                    {
+                        glGenBuffers(1, &chunk.buffer);
+                        glBindBuffer(GL_ARRAY_BUFFER, chunk.buffer);
+                        glBufferData(GL_ARRAY_BUFFER, chunk.vertices.size() * sizeof(float), vertices, GL_STATIC_DRAW);
+                    }
+                    else
+                        glBindBuffer(GL_ARRAY_BUFFER, chunk.buffer);
+                    vertices = 0;
+                }
+                glVertexPointer(3, GL_FLOAT, 6 * sizeof(float), vertices);
+                glNormalPointer(GL_FLOAT, 6 * sizeof(float), vertices + 3);
+                glDrawElements(GL_TRIANGLES, count[level], GL_UNSIGNED_SHORT, indexBase + first[level]);
+                chunksDrawn++;
+                trianglesDrawn += count[level] / 3;
+            }
+
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        if (bufferObjects)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        }
+
+        // a chunk of slack, so chunks at the edge of the range do not get rebuilt over and over
+        for (std::unordered_map<long long, Chunk>::iterator iChunk = chunks.begin(); iChunk != chunks.end(); )
+        {
+            int chunkX = (int)(unsigned int)((unsigned long long)iChunk->first >> 32);
+            int chunkZ = (int)(unsigned int)iChunk->first;
+            if (chunkX < minX - 1 || chunkX > maxX + 1 || chunkZ < minZ - 1 || chunkZ > maxZ + 1)
+            {
+                release(iChunk->second);
+                iChunk = chunks.erase(iChunk);
+            }
+            else
+                ++iChunk;
+        }
+    }
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+//Work-stealing thread pool.
+//Each worker owns a deque: it pops its own work from the back and steals from the front of the
+//others' when it runs dry. The thread calling parallelFor helps out until its batch is finished.
+class ThreadPool
+{
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()> > tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<Queue*> queues;
+    std::atomic<bool> stopping;
+    std::atomic<int> queued;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<unsigned int> nextQueue;
+
+    bool popFrom(int q, bool back, std::function<void()>& task)
+    {
+        std::lock_guard<std::mutex> lock(queues[q]->mutex);
+        std::deque<std::function<void()> >& tasks = queues[q]->tasks;
+        if (tasks.empty())
+            return false;
+        if (back)
+        {
+            task = tasks.back();
+            tasks.pop_back();
+        }
+        else
+        {
+            task = tasks.front();
+            tasks.pop_front();
+        }
+        queued--;
+        return true;
+    }
+
+    //Own queue first, then steal round the others
+    bool findTask(int self, std::function<void()>& task)
+    {
+        int n = queues.size();
+        if (self >= 0 && popFrom(self, true, task))
+            return true;
+        int start = self >= 0 ? self + 1 : 0;
+        for (int i = 0; i<n; i++)
+            if (popFrom((start + i) % n, false, task))
+                return true;
+        return false;
+    }
+
+    void workerLoop(int self)
+    {
+        std::function<void()> task;
+        while (!stopping)
+        {
+            if (findTask(self, task))
+            {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this]{ return stopping || queued > 0; });
+        }
+    }
+
+public:
+    ThreadPool(int threads = std::thread::hardware_concurrency()):stopping(false),queued(0),nextQueue(0)
+    {
+        if (threads < 1)
+            threads = 1;
+        for (int i = 0; i<threads; i++)
+            queues.push_back(new Queue());
+        for (int i = 0; i<threads; i++)
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (unsigned int i = 0; i<workers.size(); i++)
+            workers[i].join();
+        for (unsigned int i = 0; i<queues.size(); i++)
+            delete queues[i];
+    }
+
+    int size()
+    {
+        return workers.size();
+    }
+
+    //Queues a task on one of the workers and returns immediately
+    void submit(std::function<void()> task)
+    {
+        int q = nextQueue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            queues[q]->tasks.push_back(task);
+            queued++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_one();
+    }
+
+    //Calls body(chunkBegin, chunkEnd) over [begin, end) in chunks of at most grain items and
+    //returns when every chunk has run. Small ranges run inline on the calling thread.
+    void parallelFor(int begin, int end, int grain, std::function<void(int, int)> body)
+    {
+        if (end - begin <= grain)
+        {
+            if (end > begin)
+                body(begin, end);
+            return;
+        }
+
+        std::atomic<int> remaining((end - begin + grain - 1) / grain);
+        int q = 0;
+        for (int chunk = begin; chunk<end; chunk += grain)
+        {
+            int chunkEnd = chunk + grain < end ? chunk + grain : end;
+            std::function<void()> task = [&body, &remaining, chunk, chunkEnd]
+            {
+                body(chunk, chunkEnd);
+                remaining--;
+            };
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            queues[q]->tasks.push_back(task);
+            queued++;
+            q = (q + 1) % queues.size();
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_all();
+
+        std::function<void()> task;
+        while (remaining > 0)
+        {
+            if (findTask(-1, task))
+                task();
+            else
+                std::this_thread::yield();
+        }
+    }
+};
@@ -0,0 +1,404 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+#include "float3.h"
+
+//Bounding volume hierarchy over the triangles of one mesh, in its model space, for exact sphere and
+//ray queries (collisions, picking, line of sight) in logarithmic time. Built top down with the surface
+//area heuristic over binned triangle centroids. Nodes live in one array, the two children of a node
+//next to each other, and the triangles are copied out in leaf order so a leaf reads one contiguous run.
+class TriangleBVH
+{
+public:
+    struct Hit
+    {
+        float t;                // distance along the ray, in units of its direction
+        unsigned int triangle;  // index of the triangle in the mesh's index array (first index / 3)
+    };
+
+private:
+    struct Node
+    {
+        float3 min;
+        unsigned int first;     // first triangle of a leaf, left child of an inner node (right is first + 1)
+        float3 max;
+        unsigned int count;     // triangles of a leaf, 0 for inner nodes
+    };
+
+    struct Triangle
+    {
+        float3 a, b, c;
+    };
+
+    static const int binCount = 12;
+    static const unsigned int maxLeafSize = 8;
+    static const unsigned int maxDepth = 60;   // queries keep at most one stack entry per level
+
+    std::vector<Node> nodes;
+    std::vector<Triangle> triangles;
+    std::vector<unsigned int> triangleIds;
+
+    //build scratch, indexed by mesh triangle
+    std::vector<float3> centroids;
+    std::vector<float3> boxMin;
+    std::vector<float3> boxMax;
+
+    //plain comparisons compile to single instructions, fminf and fmaxf to calls that handle NaNs
+    static float lesser(float a, float b)
+    {
+        return a < b ? a : b;
+    }
+
+    static float greater(float a, float b)
+    {
+        return a > b ? a : b;
+    }
+
+    static float3 minimum(float3 a, float3 b)
+    {
+        return float3(lesser(a.x, b.x), lesser(a.y, b.y), lesser(a.z, b.z));
+    }
+
+    static float3 maximum(float3 a, float3 b)
+    {
+        return float3(greater(a.x, b.x), greater(a.y, b.y), greater(a.z, b.z));
+    }
+
+    static float axis(float3 v, int a)
+    {
+        return a == 0 ? v.x : a == 1 ? v.y : v.z;
+    }
+
+    static float halfArea(float3 min, float3 max)
+    {
+        float3 e = max - min;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+
+    void subdivide(unsigned int index, unsigned int depth)
+    {
+        Node& node = nodes[index];
+        unsigned int first = node.first;
+        unsigned int count = node.count;
+        float3 centroidMin = centroids[triangleIds[first]];
+        float3 centroidMax = centroidMin;
+        node.min = boxMin[triangleIds[first]];
+        node.max = boxMax[triangleIds[first]];
+        for (unsigned int i = first + 1; i < first + count; i++)
+        {
+            unsigned int t = triangleIds[i];
+            node.min = minimum(node.min, boxMin[t]);
+            node.max = maximum(node.max, boxMax[t]);
+            centroidMin = minimum(centroidMin, centroids[t]);
+            centroidMax = maximum(centroidMax, centroids[t]);
+        }
+        if (count <= 2 || depth >= maxDepth)
+            return;
+
+        // sweep the bins of every axis for the cheapest split: the area of each side times its triangles
+        float bestCost = halfArea(node.min, node.max) * count;
+        int bestAxis = -1;
+        int bestSplit = 0;
+        for (int a = 0; a < 3; a++)
+        {
+            float low = axis(centroidMin, a);
+            float extent = axis(centroidMax, a) - low;
+            if (extent <= 0)
+                continue;
+            float3 binMin[binCount], binMax[binCount];
+            unsigned int binTriangles[binCount] = {0};
+            float scale = binCount / extent;
+            for (unsigned int i = first; i < first + count; i++)
+            {
+                unsigned int t = triangleIds[i];
+                int bin = std::min(binCount - 1, (int)((axis(centroids[t], a) - low) * scale));
+                binMin[bin] = binTriangles[bin] ? minimum(binMin[bin], boxMin[t]) : boxMin[t];
+                binMax[bin] = binTriangles[bin] ? maximum(binMax[bin], boxMax[t]) : boxMax[t];
+                binTriangles[bin]++;
+            }
+            // areas and counts of everything left of each split plane, then sweep back from the right
+            float leftArea[binCount - 1];
+            unsigned int leftCount[binCount - 1];
+            float3 sideMin, sideMax;
+            unsigned int side = 0;
+            for (int b = 0; b < binCount - 1; b++)
+            {
+                if (binTriangles[b])
+                {
+                    sideMin = side ? minimum(sideMin, binMin[b]) : binMin[b];
+                    sideMax = side ? maximum(sideMax, binMax[b]) : binMax[b];
+                    side += binTriangles[b];
+                }
+                leftCount[b] = side;
+                leftArea[b] = side ? halfArea(sideMin, sideMax) : 0;
+            }
+            side = 0;
+            for (int b = binCount - 1; b > 0; b--)
+            {
+                if (binTriangles[b])
+                {
+                    sideMin = side ? minimum(sideMin, binMin[b]) : binMin[b];
+                    sideMax = side ? maximum(sideMax, binMax[b]) : binMax[b];
+                    side += binTriangles[b];
+                }
+                if (!side || !leftCount[b - 1])
+                    continue;
+                float cost = leftArea[b - 1] * leftCount[b - 1] + halfArea(sideMin, sideMax) * side;
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestSplit = b;
+                }
+            }
+        }
+        // splitting does not pay; big leaves are still split in the middle of the longest axis
+        if (bestAxis < 0)
+        {
+            if (count <= maxLeafSize)
+                return;
+            float3 extent = centroidMax - centroidMin;
+            if (extent.x <= 0 && extent.y <= 0 && extent.z <= 0)
+                return;
+            bestAxis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+            bestSplit = binCount / 2;
+        }
+
+        float low = axis(centroidMin, bestAxis);
+        float scale = binCount / (axis(centroidMax, bestAxis) - low);
+        unsigned int* begin = &triangleIds[first];
+        unsigned int* middle = std::partition(begin, begin + count, [&](unsigned int t)
+                                              {
+                                                  return std::min(binCount - 1, (int)((axis(centroids[t], bestAxis) - low) * scale)) < bestSplit;
+                                              });
+        unsigned int leftCount = middle - begin;
+        if (leftCount == 0 || leftCount == count)
+            return;
+
+        unsigned int left = nodes.size();
+        Node child;
+        child.count = leftCount;
+        child.first = first;
+        nodes.push_back(child);
+        child.count = count - leftCount;
+        child.first = first + leftCount;
+        nodes.push_back(child);
+        nodes[index].first = left;
+        nodes[index].count = 0;
+        subdivide(left, depth + 1);
+        subdivide(left + 1, depth + 1);
+    }
+
+    //Ray against box, with the reciprocal direction; true if they meet before maxT
+    static bool rayHitsBox(float3 origin, float3 inverse, float maxT, float3 min, float3 max, float& entry)
+    {
+        float tx0 = (min.x - origin.x) * inverse.x, tx1 = (max.x - origin.x) * inverse.x;
+        float ty0 = (min.y - origin.y) * inverse.y, ty1 = (max.y - origin.y) * inverse.y;
+        float tz0 = (min.z - origin.z) * inverse.z, tz1 = (max.z - origin.z) * inverse.z;
+        float enter = greater(greater(lesser(tx0, tx1), lesser(ty0, ty1)), greater(lesser(tz0, tz1), 0));
+        float leave = lesser(lesser(greater(tx0, tx1), greater(ty0, ty1)), lesser(greater(tz0, tz1), maxT));
+        entry = enter;
+        return enter <= leave;
+    }
+
+    //Moller-Trumbore; t of the hit or a negative value
+    static float rayHitsTriangle(float3 origin, float3 direction, const Triangle& triangle)
+    {
+        float3 e1 = triangle.b - triangle.a;
+        float3 e2 = triangle.c - triangle.a;
+        float3 p = direction.cross(e2);
+        float determinant = e1.dot(p);
+        if (fabsf(determinant) < 1e-12f)
+            return -1;
+        float inverse = 1 / determinant;
+        float3 s = origin - triangle.a;
+        float u = s.dot(p) * inverse;
+        if (u < 0 || u > 1)
+            return -1;
+        float3 q = s.cross(e1);
+        float v = direction.dot(q) * inverse;
+        if (v < 0 || u + v > 1)
+            return -1;
+        return e2.dot(q) * inverse;
+    }
+
+    //Point of the triangle closest to p (Ericson, Real-Time Collision Detection 5.1.5)
+    static float3 closestPoint(float3 p, const Triangle& triangle)
+    {
+        float3 a = triangle.a, b = triangle.b, c = triangle.c;
+        float3 ab = b - a, ac = c - a, ap = p - a;
+        float d1 = ab.dot(ap), d2 = ac.dot(ap);
+        if (d1 <= 0 && d2 <= 0)
+            return a;
+        float3 bp = p - b;
+        float d3 = ab.dot(bp), d4 = ac.dot(bp);
+        if (d3 >= 0 && d4 <= d3)
+            return b;
+        float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0)
+            return a + ab * (d1 / (d1 - d3));
+        float3 cp = p - c;
+        float d5 = ab.dot(cp), d6 = ac.dot(cp);
+        if (d6 >= 0 && d5 <= d6)
+            return c;
+        float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0)
+            return a + ac * (d2 / (d2 - d6));
+        float va = d3 * d6 - d5 * d4;
+        if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+            return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+        float denominator = 1 / (va + vb + vc);
+        return a + ab * (vb * denominator) + ac * (vc * denominator);
+    }
+
+    static float boxDistance2(float3 p, float3 min, float3 max)
+    {
+        float dx = greater(greater(min.x - p.x, p.x - max.x), 0);
+        float dy = greater(greater(min.y - p.y, p.y - max.y), 0);
+        float dz = greater(greater(min.z - p.z, p.z - max.z), 0);
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+public:
+    //Builds over indexCount / 3 triangles; positions are read stride floats apart
+    void build(const float* positions, unsigned int stride, const unsigned int* indices, unsigned int indexCount)
+    {
+        nodes.clear();
+        triangles.clear();
+        unsigned int count = indexCount / 3;
+        if (count == 0)
+            return;
+        centroids.resize(count);
+        boxMin.resize(count);
+        boxMax.resize(count);
+        triangleIds.resize(count);
+        for (unsigned int t = 0; t < count; t++)
+        {
+            const float* a = positions + indices[3 * t] * stride;
+            const float* b = positions + indices[3 * t + 1] * stride;
+            const float* c = positions + indices[3 * t + 2] * stride;
+            float3 pa(a[0], a[1], a[2]), pb(b[0], b[1], b[2]), pc(c[0], c[1], c[2]);
+            boxMin[t] = minimum(minimum(pa, pb), pc);
+            boxMax[t] = maximum(maximum(pa, pb), pc);
+            centroids[t] = (pa + pb + pc) * (1.0f / 3);
+            triangleIds[t] = t;
+        }
+        nodes.reserve(2 * count);
+        Node root;
+        root.first = 0;
+        root.count = count;
+        nodes.push_back(root);
+        subdivide(0, 0);
+
+        triangles.resize(count);
+        for (unsigned int i = 0; i < count; i++)
+        {
+            unsigned int t = triangleIds[i];
+            const float* a = positions + indices[3 * t] * stride;
+            const float* b = positions + indices[3 * t + 1] * stride;
+            const float* c = positions + indices[3 * t + 2] * stride;
+            triangles[i].a = float3(a[0], a[1], a[2]);
+            triangles[i].b = float3(b[0], b[1], b[2]);
+            triangles[i].c = float3(c[0], c[1], c[2]);
+        }
+        std::vector<float3>().swap(centroids);
+        std::vector<float3>().swap(boxMin);
+        std::vector<float3>().swap(boxMax);
+    }
+
+    bool isEmpty() const
+    {
+        return nodes.empty();
+    }
+
+    unsigned int nodeCount() const
+    {
+        return nodes.size();
+    }
+
+    unsigned int triangleCount() const
+    {
+        return triangles.size();
+    }
+
+    //Nearest triangle the ray origin + t * direction crosses with 0 <= t <= maxT, either side facing
+    bool intersectRay(float3 origin, float3 direction, float maxT, Hit& hit) const
+    {
+        if (nodes.empty())
+            return false;
+        float3 inverse(1 / direction.x, 1 / direction.y, 1 / direction.z);
+        hit.t = maxT;
+        bool found = false;
+        float entry;
+        if (!rayHitsBox(origin, inverse, maxT, nodes[0].min, nodes[0].max, entry))
+            return false;
+        unsigned int stack[64];
+        int depth = 0;
+        stack[depth++] = 0;
+        while (depth > 0)
+        {
+            const Node& node = nodes[stack[--depth]];
+            if (node.count)
+            {
+                for (unsigned int i = node.first; i < node.first + node.count; i++)
+                {
+                    float t = rayHitsTriangle(origin, direction, triangles[i]);
+                    if (t >= 0 && t <= hit.t)
+                    {
+                        hit.t = t;
+                        hit.triangle = triangleIds[i];
+                        found = true;
+                    }
+                }
+                continue;
+            }
+            // nearer child on top of the stack, so a close hit prunes the other one
+            float leftEntry, rightEntry;
+            bool left = rayHitsBox(origin, inverse, hit.t, nodes[node.first].min, nodes[node.first].max, leftEntry);
+            bool right = rayHitsBox(origin, inverse, hit.t, nodes[node.first + 1].min, nodes[node.first + 1].max, rightEntry);
+            if (left && right && leftEntry < rightEntry)
+            {
+                stack[depth++] = node.first + 1;
+                stack[depth++] = node.first;
+            }
+            else
+            {
+                if (left)
+                    stack[depth++] = node.first;
+                if (right)
+                    stack[depth++] = node.first + 1;
+            }
+        }
+        return found;
+    }
+
+    //True if any triangle comes within radius of center
+    bool intersectsSphere(float3 center, float radius) const
+    {
+        if (nodes.empty())
+            return false;
+        float radius2 = radius * radius;
+        unsigned int stack[64];
+        int depth = 0;
+        stack[depth++] = 0;
+        while (depth > 0)
+        {
+            const Node& node = nodes[stack[--depth]];
+            if (boxDistance2(center, node.min, node.max) > radius2)
+                continue;
+            if (node.count)
+            {
+                for (unsigned int i = node.first; i < node.first + node.count; i++)
+                    if ((closestPoint(center, triangles[i]) - center).norm2() <= radius2)
+                        return true;
+                continue;
+            }
+            stack[depth++] = node.first;
+            stack[depth++] = node.first + 1;
+        }
+        return false;
+    }
+};
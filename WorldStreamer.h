@@ -0,0 +1,271 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "float3.h"
+#include "ThreadPool.h"
+
+//One placed object of a streamed world
+struct WorldProp
+{
+    enum Type { tree };
+
+    uint32_t type;
+    float3 position;
+    float scale;
+    float angle;            // degrees around y
+};
+
+//A world cut into square tiles on the ground plane, stored one file per tile, and kept in memory only
+//around a center point (the avatar). Tiles are read on a background thread a ring ahead of where they
+//are needed. Which tiles are active only depends on the center's tile, never on loading speed, so runs
+//stay deterministic: a tile that has to become active before its read is done is waited for.
+//Files: <dir>/world.wld is "WRLD", version, chunk size and the tile range; <dir>/<x>_<z>.chunk is
+//"WCHK", version, prop count and the props. Tiles without a file are empty.
+class WorldStreamer
+{
+public:
+    struct Chunk
+    {
+        int x;
+        int z;
+        std::vector<WorldProp> props;
+        bool ready;         // props are read
+        bool active;        // handed out by update() and not taken back yet
+    };
+
+    static const uint32_t version = 1;
+
+private:
+    std::string directory;
+    float chunkSize;
+    int minX, minZ, maxX, maxZ;
+    int activeRadius;       // in tiles, around the center tile
+    int prefetchRadius;
+    std::map<std::pair<int, int>, Chunk*> chunks;
+    ThreadPool* loader;
+    std::mutex readyMutex;
+    std::condition_variable readyCondition;
+    int pending;
+
+    static std::string chunkName(const std::string& directory, int x, int z)
+    {
+        char name[64];
+        sprintf(name, "/%d_%d.chunk", x, z);
+        return directory + name;
+    }
+
+    void request(int x, int z)
+    {
+        if (x < minX || x > maxX || z < minZ || z > maxZ || chunks.count(std::make_pair(x, z)))
+            return;
+        Chunk* chunk = new Chunk();
+        chunk->x = x;
+        chunk->z = z;
+        chunk->ready = false;
+        chunk->active = false;
+        chunks[std::make_pair(x, z)] = chunk;
+        {
+            std::lock_guard<std::mutex> lock(readyMutex);
+            pending++;
+        }
+        std::string filename = chunkName(directory, x, z);
+        loader->submit([this, chunk, filename]
+                       {
+                           std::vector<WorldProp> props;
+                           readChunk(filename.c_str(), props);
+                           std::lock_guard<std::mutex> lock(readyMutex);
+                           chunk->props.swap(props);
+                           chunk->ready = true;
+                           pending--;
+                           readyCondition.notify_all();
+                       });
+    }
+
+    void waitFor(Chunk* chunk)
+    {
+        std::unique_lock<std::mutex> lock(readyMutex);
+        readyCondition.wait(lock, [chunk]{ return chunk->ready; });
+    }
+
+    bool isReady(Chunk* chunk)
+    {
+        std::lock_guard<std::mutex> lock(readyMutex);
+        return chunk->ready;
+    }
+
+    static int ringDistance(int x0, int z0, int x1, int z1)
+    {
+        return std::max(abs(x1 - x0), abs(z1 - z0));
+    }
+
+public:
+    WorldStreamer(int activeRadius = 2, int prefetchRadius = 3):chunkSize(0),minX(0),minZ(0),maxX(-1),maxZ(-1),
+        activeRadius(activeRadius),prefetchRadius(std::max(prefetchRadius, activeRadius)),loader(0),pending(0){}
+
+    ~WorldStreamer()
+    {
+        if (loader)
+        {
+            std::unique_lock<std::mutex> lock(readyMutex);
+            readyCondition.wait(lock, [this]{ return pending == 0; });
+        }
+        delete loader;
+        for (std::map<std::pair<int, int>, Chunk*>::iterator iChunk = chunks.begin(); iChunk != chunks.end(); ++iChunk)
+            delete iChunk->second;
+    }
+
+    //Reads the manifest; false if the directory holds no world
+    bool open(const char* worldDirectory)
+    {
+        directory = worldDirectory;
+        FILE* file = fopen((directory + "/world.wld").c_str(), "rb");
+        if (!file)
+            return false;
+        char magic[4];
+        uint32_t fileVersion;
+        int32_t range[4];
+        bool ok = fread(magic, 4, 1, file) == 1 && memcmp(magic, "WRLD", 4) == 0 && fread(&fileVersion, 4, 1, file) == 1
+            && fileVersion == version && fread(&chunkSize, 4, 1, file) == 1 && fread(range, 4, 4, file) == 4 && chunkSize > 0;
+        fclose(file);
+        if (!ok)
+            return false;
+        minX = range[0];
+        minZ = range[1];
+        maxX = range[2];
+        maxZ = range[3];
+        if (!loader)
+            loader = new ThreadPool(1);
+        return true;
+    }
+
+    float getChunkSize()
+    {
+        return chunkSize;
+    }
+
+    //Distance from the origin to the furthest tile corner
+    float extent()
+    {
+        float x = std::max(abs(minX), abs(maxX + 1)) * chunkSize;
+        float z = std::max(abs(minZ), abs(maxZ + 1)) * chunkSize;
+        return sqrtf(x * x + z * z);
+    }
+
+    int residentChunks()
+    {
+        return chunks.size();
+    }
+
+    //Moves the window to center. Chunks that have to be instantiated are appended to activate, nearest
+    //first, and chunks whose instances should go to deactivate; both stay valid until the next update.
+    void update(float3 center, std::vector<Chunk*>& activate, std::vector<Chunk*>& deactivate)
+    {
+        int cx = (int)floorf(center.x / chunkSize);
+        int cz = (int)floorf(center.z / chunkSize);
+
+        // give active chunks a tile of slack before dropping them, so walking along a border does not thrash
+        for (std::map<std::pair<int, int>, Chunk*>::iterator iChunk = chunks.begin(); iChunk != chunks.end(); ++iChunk)
+        {
+            Chunk* chunk = iChunk->second;
+            if (chunk->active && ringDistance(cx, cz, chunk->x, chunk->z) > activeRadius + 1)
+            {
+                chunk->active = false;
+                deactivate.push_back(chunk);
+            }
+        }
+
+        for (int ring = 0; ring <= prefetchRadius; ring++)
+            for (int x = cx - ring; x <= cx + ring; x++)
+                for (int z = cz - ring; z <= cz + ring; z++)
+                    if (ringDistance(cx, cz, x, z) == ring)
+                        request(x, z);
+
+        for (int ring = 0; ring <= activeRadius; ring++)
+            for (int x = cx - ring; x <= cx + ring; x++)
+                for (int z = cz - ring; z <= cz + ring; z++)
+                {
+                    if (ringDistance(cx, cz, x, z) != ring)
+                        continue;
+                    std::map<std::pair<int, int>, Chunk*>::iterator iChunk = chunks.find(std::make_pair(x, z));
+                    if (iChunk == chunks.end() || iChunk->second->active)
+                        continue;
+                    waitFor(iChunk->second);
+                    iChunk->second->active = true;
+                    activate.push_back(iChunk->second);
+                }
+
+        // forget read chunks well outside the prefetch ring; the ones deactivated just now live until the next update
+        for (std::map<std::pair<int, int>, Chunk*>::iterator iChunk = chunks.begin(); iChunk != chunks.end(); )
+        {
+            Chunk* chunk = iChunk->second;
+            if (!chunk->active && ringDistance(cx, cz, chunk->x, chunk->z) > prefetchRadius + 1 && isReady(chunk)
+                && std::find(deactivate.begin(), deactivate.end(), chunk) == deactivate.end())
+            {
+                delete chunk;
+                chunks.erase(iChunk++);
+            }
+            else
+                ++iChunk;
+        }
+    }
+
+    static bool readChunk(const char* filename, std::vector<WorldProp>& props)
+    {
+        FILE* file = fopen(filename, "rb");
+        if (!file)
+            return false;
+        char magic[4];
+        uint32_t fileVersion, count;
+        bool ok = fread(magic, 4, 1, file) == 1 && memcmp(magic, "WCHK", 4) == 0 && fread(&fileVersion, 4, 1, file) == 1
+            && fileVersion == version && fread(&count, 4, 1, file) == 1;
+        if (ok)
+        {
+            props.resize(count);
+            ok = count == 0 || fread(&props[0], sizeof(WorldProp), count, file) == count;
+        }
+        fclose(file);
+        if (!ok)
+            props.clear();
+        return ok;
+    }
+
+    static bool writeChunk(const char* worldDirectory, int x, int z, const std::vector<WorldProp>& props)
+    {
+        FILE* file = fopen(chunkName(worldDirectory, x, z).c_str(), "wb");
+        if (!file)
+            return false;
+        uint32_t header[2] = {version, (uint32_t)props.size()};
+        uint32_t count = header[1];
+        fwrite("WCHK", 4, 1, file);
+        fwrite(header, 4, 2, file);
+        if (count)
+            fwrite(&props[0], sizeof(WorldProp), count, file);
+        return fclose(file) == 0;
+    }
+
+    static bool writeManifest(const char* worldDirectory, float chunkSize, int minX, int minZ, int maxX, int maxZ)
+    {
+        FILE* file = fopen((std::string(worldDirectory) + "/world.wld").c_str(), "wb");
+        if (!file)
+            return false;
+        int32_t range[4] = {minX, minZ, maxX, maxZ};
+        uint32_t fileVersion = version;
+        fwrite("WRLD", 4, 1, file);
+        fwrite(&fileVersion, 4, 1, file);
+        fwrite(&chunkSize, 4, 1, file);
+        fwrite(range, 4, 4, file);
+        return fclose(file) == 0;
+    }
+};